@@ -7,9 +7,11 @@
 // Works with Yamaha CLP-745 Digital Piano
 
 #define APPLEMIDI_INITIATOR
+#define USE_EXT_CALLBACKS // AppleMIDI tells us which peer a packet came from, for the rate limits
 
 #include <MIDI.h>
 #include <AppleMIDI.h>
+#define FASTLED_USE_PROGMEM 1 // keep gradient palettes in flash, pgm_read works on any address on the ESP8266
 #include "FastLED.h"
 //#include <AltSoftSerial.h>
 
@@ -17,16 +19,33 @@
 #include <ESP8266WiFi.h>
 #include <ESP8266WiFiMulti.h>
 #include <ArduinoOTA.h>
+#define DEBUG_USE_FLASH_F // debugX format strings are stored in flash
 #include "RemoteDebug.h"  //https://github.com/JoaoLopesF/RemoteDebug
 
 #include <EEPROM.h>
-#define EEPROM_SIZE 1
+#include <LittleFS.h>
+#define EEPROM_SIZE (PRESET_EEPROM_ADDR + 1 + sizeof(presets))
 #define AUTO_RESTORE_LAST_MODE true
 
 RemoteDebug Debug;
 
+// Code marked HOT_PATH runs from IRAM instead of through the 32 KB flash cache, so a cache miss
+// can't stretch note-to-light latency.
+// IRAM is scarce, so it's only the note path itself: OnNoteOn/OnNoteOff, the event queue,
+// noteOn/noteOff, showLeds and the fade kernels. Overlays and effects run from flash.
+// Set HOT_PATH_IN_IRAM to false if the core's own IRAM use grows.
+// tools/size_report.py lists RAM/IRAM/flash use per subsystem from the built ELF.
+#define HOT_PATH_IN_IRAM true
+#if HOT_PATH_IN_IRAM
+#define HOT_PATH ICACHE_RAM_ATTR
+#else
+#define HOT_PATH
+#endif
+#define FORCE_INLINE inline __attribute__((always_inline))
+
 ESP8266WiFiMulti wifiMulti;     // Create an instance of the ESP8266WiFiMulti class, called 'wifiMulti'
 
+// Default pins, can be overridden in settings.txt
 #define clkPin  12 //A
 #define dtPin   13 //B
 #define btnPin  14
@@ -37,7 +56,7 @@ int idx = 0;
 bool autoModeOn = true;
 byte autoMode = 6;
 unsigned long lastKeyPress;
-#define SLEEP_TIMER 10000//20
+#define SLEEP_TIMER 10000//20 // seconds, can be overridden in settings.txt
 
 FASTLED_USING_NAMESPACE
 
@@ -60,17 +79,133 @@ boolean onLeds[NUM_LEDS];
 boolean fadeLeds[NUM_LEDS];
 boolean doNotFade[NUM_LEDS];
 
-CRGB rainbowPalette[NUM_LEDS];
-
 int currAnalogRead;
 
+// Buttons are polled from the loop: a short press acts when it's released, holding one down for
+// BUTTON_HOLD_MS does its second function (next preset, replay) once, without stopping the loop.
+#define BUTTON_HOLD_MS 500
+#define BUTTON_DEBOUNCE_MS 30
+enum ButtonAction : uint8_t { BUTTON_NONE, BUTTON_TAP, BUTTON_HOLD };
+struct ButtonState {
+  uint32_t downMs;
+  bool down;
+  bool held;            // the hold action is done, the release does nothing
+};
+ButtonState modeButton, powerButton;  // encoder button (pinBtn), on/off button (pinButton)
+
+// A flash commit erases a sector (tens of ms), so a new mode is committed from the idle stage once
+// it has stayed put for MODE_COMMIT_MS; cycling through modes writes the flash once.
+#define MODE_COMMIT_MS 2000
+bool modeUnsaved = false;
+uint32_t modeChangedMs;
+
 #define MIN_BRIGHTNESS 130
 #define BRIGHTNESS  255//90
+uint8_t potBrightness = BRIGHTNESS; // brightness knob, before the power limit
 #define PASSIVE_FPS 120
 
 APPLEMIDI_CREATE_INSTANCE(WiFiUDP, MIDI_WIFI, "Yamaha CLP745", DEFAULT_CONTROL_PORT);
 int8_t isConnected = 0;
 
+// SETTINGS FILE
+// /settings.txt on LittleFS holds "key = value" lines (# starts a comment). It is read by a
+// streaming tokenizer into a fixed Settings struct, no heap and a bounded stack. "reload" over
+// telnet parses it into the spare buffer and swaps the active pointer only if that succeeded.
+// The LED data pin is a template parameter of FastLED and cannot be changed at runtime.
+#define SETTINGS_FILE "/settings.txt"
+#define CUE_CHANNEL 16    // default, can be overridden in settings.txt
+
+struct Settings {
+  char wifiSsid[33];
+  char wifiPass[65];
+  uint8_t midiPeer[4];    // AppleMIDI session to invite
+  uint16_t midiPort;
+  uint16_t sleepTimer;    // seconds without notes before passive mode
+  uint8_t pedalFade;      // fades of preset 0
+  uint8_t releaseFade;
+  uint8_t holdFade;
+  uint8_t pinClk;         // rotary encoder A
+  uint8_t pinDt;          // rotary encoder B
+  uint8_t pinBtn;         // rotary encoder button
+  uint8_t pinButton;      // on/off button
+  uint8_t cueChannel;     // network MIDI channel that fires cues
+};
+
+const Settings defaultSettings PROGMEM = {
+  "Dom", "Internet2014$",
+  { 192, 168, 1, 152 }, DEFAULT_CONTROL_PORT,
+  SLEEP_TIMER,
+  PEDAL_STRENGTH, NO_PEDAL_STRENGTH, NOTE_HOLD_FADE,
+  clkPin, dtPin, btnPin, button_pin,
+  CUE_CHANNEL
+};
+
+Settings settingsBuf[2];
+const Settings* config = &settingsBuf[0];
+unsigned long configParseMicros;
+
+// STALL DETECTOR
+// loop() is split in stages, each with a time budget. enterStage() closes the previous stage
+// and records overruns; a loop taking longer than STALL_LOOP_MS is a stall. The flight recorder
+// keeps the last FLIGHT_SIZE notable events (notes, mode changes, overruns...).
+// On a stall, and from the core's crash callback on exceptions and soft WDT resets, the current
+// stage, recent flight entries, serial queue depth and stack headroom go to RTC memory, which
+// survives the reset and is reported on the next boot ("lastReset" over telnet).
+// The self-tests (bench, flood, kernels check...) block the loop on purpose and restart the clocks
+// when they're done, see resetStallClock().
+#define STALL_LOOP_MS 2000     // the soft WDT fires after ~3.2 s
+#define FLIGHT_SIZE 16
+#define STALL_RTC_OFFSET 32    // in 4-byte blocks, clear of the OTA command at block 64
+#define STALL_MAGIC 0x57A11ED0
+
+enum LoopStage : uint8_t {
+  STAGE_IDLE, STAGE_OTA, STAGE_INPUTS, STAGE_PALETTE, STAGE_MIDI, STAGE_MIDI_WIFI,
+  STAGE_EVENTS, STAGE_PASSIVE, STAGE_PATTERNS, STAGE_SHOW, STAGE_DEBUG, STAGE_COUNT
+};
+const char stageNames[STAGE_COUNT][9] PROGMEM = {
+  "idle", "ota", "inputs", "palette", "midi", "midiWifi", "events", "passive", "patterns", "show", "debug"
+};
+// Budget per stage in ms.
+const uint16_t stageBudgetMs[STAGE_COUNT] = { 0, 20, 2, 2, 10, 20, 5, 20, 2, 15, 20 };
+
+enum FlightKind : uint8_t {
+  FLIGHT_NOTE_ON = 1, FLIGHT_NOTE_OFF, FLIGHT_CC, FLIGHT_PROGRAM, FLIGHT_WIFI_NOTE_ON, FLIGHT_WIFI_NOTE_OFF,
+  FLIGHT_MODE, FLIGHT_OVERRUN, FLIGHT_SESSION, FLIGHT_STALL, FLIGHT_CUE
+};
+
+struct FlightEntry {
+  uint32_t ms;
+  uint8_t kind;
+  uint8_t a;
+  uint16_t b;
+};
+
+struct StallCapture {
+  uint32_t magic;
+  uint32_t uptimeMs;
+  uint32_t reason;        // rst_info reason, or 0xFF for a stall the loop recovered from
+  uint8_t stage;
+  uint8_t serialQueue;    // bytes waiting in the MIDI serial buffer
+  uint8_t eventQueue;     // events waiting for the engine
+  uint8_t reserved;
+  uint16_t stageMs;       // time spent in the stage so far
+  uint16_t stackFree;     // lowest free stack seen since boot
+  FlightEntry recent[8];
+};
+
+FlightEntry flight[FLIGHT_SIZE];
+byte flightHead = 0;
+volatile uint8_t currentStage = STAGE_IDLE;
+unsigned long stageStartMicros;
+unsigned long loopStartMillis;
+unsigned long loopCount, loopMicrosTotal, loopMicrosMax;  // loop timing since the last "mem"
+unsigned long loopStartMicros;
+uint16_t stageOverruns[STAGE_COUNT];
+StallCapture lastStall;    // what the previous boot left in RTC memory
+bool lastStallValid = false;
+
+extern "C" void custom_crash_callback(struct rst_info* rst_info, uint32_t stack, uint32_t stack_end);
+
 // MODE 5 PALETTES
 
 DEFINE_GRADIENT_PALETTE( GPVelocidad ) {
@@ -141,7 +276,8 @@ DEFINE_GRADIENT_PALETTE( GP_FreshBlue ) {
 
 #define MODE4_PALETTE_COUNT 7
 
-CRGBPalette16 mode4Palettes[] = {
+// Palette 0 is the plain rainbow, palette n uses mode4Gradients[n-1]
+const TProgmemRGBGradientPalettePtr mode4Gradients[] PROGMEM = {
   GP_Rainbow,
   GP_Tropical,
   GP_PinkChampagne,
@@ -152,7 +288,7 @@ CRGBPalette16 mode4Palettes[] = {
 
 #define MODE5_PALETTE_COUNT 2
 
-CRGBPalette16 mode5Palettes[] = {
+const TProgmemRGBGradientPalettePtr mode5Gradients[] PROGMEM = {
   GPVelocidad,
   GPHot
 };
@@ -166,6 +302,63 @@ uint8_t customSaturation = 255;
 uint8_t mode4PalIndex;
 uint8_t mode5PalIndex;
 
+// PALETTE MORPH
+// Mode 4 reads its colours from keyPalette[] (one entry per LED) and mode 5 from velocityPalette,
+// both owned by the active scene preset. When the encoder selects another palette the tables are
+// blended towards the new one over PALETTE_MORPH_MS, recomputing only PALETTE_MORPH_SLICE entries per frame.
+#define PALETTE_MORPH_MS 800
+#define PALETTE_MORPH_SLICE 22
+
+CRGB* keyPalette;
+CRGBPalette16* velocityPalette;
+CRGB morphFrom[NUM_LEDS];
+CRGBPalette16 morphTargetPalette;
+bool morphing = false;
+byte morphMode;          // 4 or 5, the table being morphed
+byte morphPos;           // next entry to recompute
+bool morphLastPass;      // blend amount reached 255, finish after this pass
+unsigned long morphStart;
+
+// SCENE PRESETS
+// A preset is a complete look. All presets are loaded from flash (EEPROM) at boot and their
+// colour and fade tables are precomputed, so switching is a pointer swap plus a few bytes copied.
+// Live palette/hue/saturation edits only change the current look, "storePreset <n>" saves it into
+// slot n. Switching presets drops unsaved edits.
+#define PRESET_COUNT 4
+#define PRESET_EEPROM_ADDR 1
+#define PRESET_MAGIC 0xA7
+#define PRESET_PROGRAM_CHANGE true  // MIDI Program Change n selects preset n
+
+struct ScenePreset {
+  byte mode;
+  uint8_t palette4;      // mode 4 palette index
+  uint8_t palette5;      // mode 5 palette index
+  uint8_t hue;
+  uint8_t saturation;
+  uint8_t pedalFade;     // fade per frame with the sustain pedal fully down
+  uint8_t releaseFade;   // fade per frame without pedal
+  uint8_t holdFade;      // fade per frame while the key is held
+};
+
+struct PresetTables {
+  CRGB keyColor[NUM_LEDS];     // mode 4 colour per LED
+  CRGBPalette16 velocity;      // mode 5 palette
+  uint8_t sustainFade[81];     // fade amount by sustain pedal position (0-80)
+};
+
+const ScenePreset factoryPresets[PRESET_COUNT] PROGMEM = {
+  { 6, 0, 0,   0, 255, PEDAL_STRENGTH, NO_PEDAL_STRENGTH, NOTE_HOLD_FADE },
+  { 4, 0, 0,   0, 255, PEDAL_STRENGTH, NO_PEDAL_STRENGTH, NOTE_HOLD_FADE },
+  { 5, 0, 1,   0, 255, 20,             80,                NOTE_HOLD_FADE },
+  { 7, 0, 0, 160, 255, 6,              40,                3 }
+};
+
+ScenePreset presets[PRESET_COUNT];
+PresetTables presetTables[PRESET_COUNT];
+byte activePreset = 0;
+const ScenePreset* scene = &presets[0];
+const PresetTables* sceneTables = &presetTables[0];
+
 struct MidiSettings : public midi::DefaultSettings // The sketch will probably work fine without these custom settings.
 {
     static const bool UseRunningStatus = true;
@@ -176,71 +369,1251 @@ MIDI_CREATE_CUSTOM_INSTANCE(HardwareSerial, Serial, MIDI, MidiSettings);
 byte sustain;
 bool DONT_FADE_NOTES = false;
 
-void OnNoteOn(byte channel, byte pitch, byte velocity) {
-  lastKeyPress = millis();
-   debugI("Note on: %s, velocity: %s, channel: %s", String(pitch).c_str(), String(velocity).c_str(), String(channel).c_str());
+// MIDI EVENTS
+// Inputs are converted on arrival into a fixed 64-bit word modeled on a MIDI 2.0 Universal MIDI
+// Packet (channel voice message), with the message type nibble replaced by the source id:
+//   head: replayed:1 source:3 status:4 | channel:4 stamp(11:8):4 | index:8 | stamp(7:0):8
+//   data: note on/off: velocity:16 attribute:16, control change: value:32
+// MIDI 1.0 values are upscaled with the MIDI 2.0 min-center-max rule. The stamp is millis()
+// modulo 4096, enough to measure how long an event waited. The engine works on these words only.
+#define EVENT_QUEUE_SIZE 32
+
+enum EventSource : uint8_t { SRC_SERIAL, SRC_WIFI };
+#define SRC_REPLAY 0x8  // or'ed into the source of replayed events, they keep their own path
+enum UmpStatus : uint8_t {
+  UMP_NOTE_OFF = 0x8, UMP_NOTE_ON = 0x9, UMP_CONTROL_CHANGE = 0xB, UMP_PROGRAM_CHANGE = 0xC
+};
+
+struct MidiEvent {
+  uint32_t head;
+  uint32_t data;
+
+  uint8_t source() const { return (head >> 28) & 0x7; }
+  bool replayed() const { return head >> 31; }
+  uint8_t status() const { return (head >> 24) & 0xF; }
+  uint8_t channel() const { return ((head >> 20) & 0xF) + 1; }  // 1-16 like the MIDI library
+  uint8_t index() const { return (head >> 8) & 0xFF; }           // note, controller or program
+  uint16_t stamp() const { return ((head >> 8) & 0xF00) | (head & 0xFF); }
+  uint16_t velocity() const { return data >> 16; }
+  uint32_t value() const { return data; }
+  uint8_t value7() const { return data >> 25; }
+
+  static MidiEvent make(uint8_t source, uint8_t status, uint8_t channel, uint8_t index, uint32_t data,
+                        uint16_t stamp = millis() & 0xFFF) {
+    MidiEvent e;
+    e.head = (uint32_t)source << 28 | (uint32_t)status << 24 | (uint32_t)((channel - 1) & 0xF) << 20
+           | (uint32_t)(stamp >> 8) << 16 | (uint32_t)index << 8 | (stamp & 0xFF);
+    e.data = data;
+    return e;
+  }
+  static MidiEvent note(uint8_t source, uint8_t status, uint8_t channel, uint8_t pitch, uint8_t velocity) {
+    return make(source, status, channel, pitch, (uint32_t)upscale16(velocity) << 16);
+  }
+  static MidiEvent control(uint8_t source, uint8_t channel, uint8_t number, uint8_t value) {
+    return make(source, UMP_CONTROL_CHANGE, channel, number, upscale32(value));
+  }
+  static MidiEvent program(uint8_t source, uint8_t channel, uint8_t number) {
+    return make(source, UMP_PROGRAM_CHANGE, channel, number, (uint32_t)number << 24);
+  }
+
+  // 7-bit to 16/32-bit: shift up, above the center value repeat the lower 6 bits into the gap
+  static constexpr uint16_t upscale16(uint8_t v) {
+    return v <= 64 ? v << 9 : (v << 9) | ((v & 0x3F) << 3) | ((v & 0x3F) >> 3);
+  }
+  static constexpr uint32_t upscale32(uint8_t v) {
+    return v <= 64 ? (uint32_t)v << 25
+                   : (uint32_t)v << 25 | (uint32_t)(v & 0x3F) << 19 | (uint32_t)(v & 0x3F) << 13
+                     | (uint32_t)(v & 0x3F) << 7 | (uint32_t)(v & 0x3F) << 1 | (v & 0x3F) >> 5;
+  }
+};
+
+// Velocity range mapped to MIN_BRIGHTNESS..255, was constrain(velocity,45,100) in 7 bits
+#define VEL_LO MidiEvent::upscale16(45)
+#define VEL_HI MidiEvent::upscale16(100)
+// Rounded up so VEL_HI lands exactly on the top value
+#define VEL_BRIGHTNESS_SCALE ((((uint32_t)(255 - MIN_BRIGHTNESS) << 16) + (VEL_HI - VEL_LO) - 1) / (VEL_HI - VEL_LO))
+#define VEL_INDEX_SCALE ((((uint32_t)240 << 16) + (VEL_HI - VEL_LO) - 1) / (VEL_HI - VEL_LO))
+
+// SUB-PIXEL DRAWING
+// Moving dots, bars and comets are drawn at 8.8 fixed point LED positions so they glide instead of
+// stepping from LED to LED. A dot spreads over the three nearest LEDs with a raised cosine profile
+// (dotWeights, 16 phases between LEDs; the light summed over the LEDs is the same at every phase),
+// bar ends light their LEDs by coverage and comet tails fall off along cometFalloff.
+// Pixels are combined with |=, the brightest wins. "bench" has the cost per primitive.
+#define SUBPIXEL_PHASES 16
+#define COMET_FALLOFF 64
+
+uint8_t dotWeights[SUBPIXEL_PHASES][3];
+uint8_t cometFalloff[COMET_FALLOFF];   // tail brightness by distance from the head
+
+struct SubPixel {
+  static FORCE_INLINE void plot(CRGB* strip, int16_t i, CRGB color, uint8_t weight) {
+    if (i < 0 || i >= NUM_LEDS || weight == 0) return;
+    color.nscale8(weight);
+    strip[i] |= color;
+  }
+};
+
+// GESTURES
+// Fast figures are recognised from the last GESTURE_HISTORY note-ons, with O(1) work per note:
+// each detector only extends or breaks its own run. A glissando (4+ steps of 1-2 keys in one
+// direction) launches a comet that keeps sweeping at the played speed. Trills (alternating keys
+// up to 2 apart), tremolos (alternating keys further apart) and repeated notes keep their keys
+// at a steady shimmer instead of flickering with every note on/off.
+#define GESTURES true
+#define GESTURE_HISTORY 8
+#define GESTURE_GAP_MS 150      // longest gap between notes of one gesture
+#define GLISS_GAP_MS 80
+#define GESTURE_MIN_RUN 4
+#define COMET_MS 400
+#define COMET_TAIL 6
+
+enum GestureType : uint8_t { GESTURE_NONE, GESTURE_GLISSANDO, GESTURE_TRILL, GESTURE_TREMOLO, GESTURE_REPEAT };
+
+struct GestureNote {
+  uint16_t ms;    // millis() & 0xFFFF
+  uint8_t led;
+};
+
+struct GestureState {
+  GestureNote history[GESTURE_HISTORY];
+  uint8_t head;            // next slot in history
+  uint8_t count;
+  uint8_t glissRun, alternateRun, repeatRun;
+  uint8_t type;            // gesture being rendered
+  uint8_t keyA, keyB;      // shimmering keys
+  int8_t direction;        // glissando: +1 towards higher LED index, -1 towards lower
+  uint16_t speed;          // glissando: LEDs per second
+  int32_t cometPos;        // glissando: 8.8 fixed point LED position
+  CRGB color;
+  uint32_t lastMs;         // last note of the gesture
+  uint32_t frameMs;        // last comet frame
+};
+
+GestureState gesture;
+
+// VOICE SWEEPS
+// The melody and the other lines are followed as voices: each note goes to the voice whose last
+// pitch is nearest (one step per voice), or starts a new one after a leap over VOICE_MAX_LEAP
+// when a voice is free. Chord notes played together go to different voices. When a voice moves
+// from one key to another, a short comet travels between them in SWEEP_MS, its colour going from
+// the old key's to the new key's. The travel time and tail are fixed, so a frame costs the same
+// however far the jump; at most SWEEPS run at once, a new one replaces the oldest.
+// "voices" over telnet shows them, "voices off|on" switches the sweeps.
+#define VOICE_SWEEPS true
+#define VOICES 3
+#define VOICE_TIMEOUT_MS 1500   // a voice silent for this long is free
+#define VOICE_MAX_LEAP 9        // semitones
+#define CHORD_MS 30             // notes closer than this are one chord
+#define SWEEPS 4
+#define SWEEP_MS 220
+#define SWEEP_TAIL 4
+
+struct Voice {
+  uint8_t pitch;           // 0 = free
+  uint8_t led;
+  CRGB color;
+  uint32_t lastMs;
+};
+
+struct Sweep {
+  uint8_t from, to;        // LEDs
+  CRGB fromColor, toColor;
+  uint32_t startMs;
+  bool active;
+};
+
+Voice voices[VOICES];
+Sweep sweeps[SWEEPS];
+uint8_t sweepHead;
+bool sweepsOn = true;
+uint32_t voiceNotes, voiceSweeps;
+
+// INTERVAL SPANS
+// Mode 8, for harmony: held keys are white and the LEDs between each pair of neighbouring held keys
+// take the colour of their interval (consonances cool, dissonances warm). The spans come from
+// walking the set bits of heldMask in order, so a change costs a step per held key plus the LEDs
+// lit; nothing is drawn or sent to the strip while the held keys stay the same.
+#define INTERVAL_MODE 8
+#define SPAN_LEVEL 70
+#define SPAN_KEY_LEVEL 200
+
+// By semitones mod 12, 0 is the octave
+const uint32_t intervalColors[12] PROGMEM = {
+  0x0040FF,   // octave
+  0xFF0000,   // minor 2nd
+  0xFF5000,   // major 2nd
+  0x00FF60,   // minor 3rd
+  0x00FF20,   // major 3rd
+  0x00C0FF,   // perfect 4th
+  0xFF00A0,   // tritone
+  0x0080FF,   // perfect 5th
+  0x40FF90,   // minor 6th
+  0x20FFC0,   // major 6th
+  0xFF9000,   // minor 7th
+  0xFF2000    // major 7th
+};
+
+bool spansDirty;               // held keys changed since the last render
+bool spansShown;               // the strip shows spans (mode 8 frames so far)
+byte spanLow = NUM_LEDS, spanHigh;  // LEDs lit by the last render
+
+// SYMPATHETIC RESONANCE
+// With the damper pedal down, strings that are still ringing and sit on a harmonic of a new note
+// glow faintly. Keys are bits of a 3 word mask (bit = LED index, so higher notes have lower bits);
+// overtoneMask[led] has the bits of the note's 2nd to 8th harmonics. A note-on ANDs it with the
+// ringing mask, so the cost is 3 ANDs plus one step per resonating key, however many keys are held.
+#define SYMPATHETIC_RESONANCE true
+#define KEY_WORDS ((NUM_LEDS + 31) / 32)
+#define RESONANCE_LEVEL 90     // glow of the 2nd harmonic at full velocity
+#define HARMONIC_COUNT 7
+#define MAX_HARMONIC_OFFSET 36
+
+const uint8_t harmonicOffsets[HARMONIC_COUNT] PROGMEM = {12, 19, 24, 28, 31, 34, 36};  // semitones above the fundamental
+const uint8_t harmonicWeights[HARMONIC_COUNT] PROGMEM = {128, 85, 64, 51, 43, 37, 32}; // ~255/n
+
+uint32_t overtoneMask[NUM_LEDS][KEY_WORDS];
+uint8_t resonanceWeight[MAX_HARMONIC_OFFSET + 1]; // by semitone distance, 0 if not a harmonic
+uint32_t heldMask[KEY_WORDS];    // keys held down
+uint32_t ringingMask[KEY_WORDS]; // held keys plus the ones kept ringing by the pedal
+
+// NOTE DENSITY
+// In dense pedalled passages every key ends up glowing and the strip washes out. A leaky note
+// counter (time constant ~1 s, so it reads in notes per second) and an average of recent note
+// brightness, 5 bytes in all, are updated once per note, and the counter decays from the loop in
+// every mode. ContrastStage in the note frame looks the density up in three curves: extra decay
+// for released keys, how much they are greyed, and how bright they may stay next to the notes
+// being played (a share of the loudness, the noise background is dimmed alike). Held keys are
+// left alone.
+// "contrast" over telnet shows the estimate, "contrast off|on" switches it.
+#define DENSITY_STEPS 16            // curve entries, one per note/s
+#define DENSITY_TAU_SHIFT 10        // time constant 1024 ms
+#define DENSITY_PER_NOTE 250        // 8.8, settles at notes/s with that time constant
+#define DENSITY_DECAY_MS 40         // decay step, shorter ones would round away slow rates
+
+struct DensityState {
+  uint16_t rate;        // notes per second, 8.8
+  uint8_t loudness;     // recent note brightness
+  uint16_t decayMs;     // millis() & 0xFFFF of the last decay
+};
+DensityState density;
+bool contrastOn = true;
+
+const uint8_t contrastFade[DENSITY_STEPS] PROGMEM = { 0, 0, 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 12 };
+const uint8_t contrastGrey[DENSITY_STEPS] PROGMEM = { 0, 0, 0, 16, 32, 48, 64, 80, 96, 112, 128, 136, 144, 152, 160, 160 };
+const uint8_t contrastCap[DENSITY_STEPS] PROGMEM = { 255, 255, 255, 220, 190, 170, 150, 135, 120, 110, 100, 95, 90, 85, 80, 80 };
+
+// FRAME PIPELINE
+// A frame pass is a list of stages, structs with begin()/end() once per frame and apply() per pixel.
+// Pipeline<A, B, C>::run() inlines all of them into a single loop over the span, so adding a stage
+// doesn't add another walk over leds[]. runMultiPass() does the same work one stage at a time,
+// it's only used by "bench" to show what fusing saves.
+#define POWER_LIMIT_MA 0    // strip current budget, 0 = no limit
+#define MA_PER_CHANNEL 20   // WS2812B channel at full scale
+#define MA_IDLE_PER_LED 1
+
+template <typename... Stages> struct Pipeline;
+
+template <> struct Pipeline<> {
+  static FORCE_INLINE void begin() {}
+  static FORCE_INLINE void apply(CRGB&, byte) {}
+  static FORCE_INLINE void end() {}
+  static void runMultiPass(CRGB*, byte, byte) {}
+};
+
+template <typename Stage, typename... Rest> struct Pipeline<Stage, Rest...> {
+  typedef Pipeline<Rest...> Next;
+  static FORCE_INLINE void begin() { Stage::begin(); Next::begin(); }
+  static FORCE_INLINE void apply(CRGB& px, byte i) { Stage::apply(px, i); Next::apply(px, i); }
+  static FORCE_INLINE void end() { Stage::end(); Next::end(); }
+
+  static FORCE_INLINE void run(CRGB* px, byte from, byte to) {
+    begin();
+    for (byte i = from; i < to; i++) apply(px[i], i);
+    end();
+  }
+
+  static void runMultiPass(CRGB* px, byte from, byte to) {
+    Stage::begin();
+    for (byte i = from; i < to; i++) Stage::apply(px[i], i);
+    Stage::end();
+    Next::runMultiPass(px, from, to);
+  }
+};
+
+// Notes that went dark are free again
+struct ExpireStage {
+  static FORCE_INLINE void begin() {}
+  static FORCE_INLINE void apply(CRGB& px, byte i) {
+    if (px.getAverageLight() <= 0) {
+      onLeds[i] = false;
+      fadeLeds[i] = false;
+      px = CRGB::Black;
+    }
+  }
+  static FORCE_INLINE void end() {}
+};
+
+// Release, pedal and hold fades from the scene
+struct EnvelopeStage {
+  static uint8_t pedalFade;
+  static FORCE_INLINE void begin() { pedalFade = sceneTables->sustainFade[constrain(sustain, 0, 80)]; }
+  static FORCE_INLINE void apply(CRGB& px, byte i) {
+    if (!onLeds[i] && !fadeLeds[i]) {
+      if (sustain > 0) {
+        if (!DONT_FADE_NOTES && !doNotFade[i]) px.fadeToBlackBy(pedalFade);
+      } else {
+        px.fadeToBlackBy(scene->releaseFade);
+      }
+    } else if (!DONT_FADE_NOTES && !doNotFade[i]) {
+      px.fadeToBlackBy(scene->holdFade);
+    }
+  }
+  static FORCE_INLINE void end() {}
+};
+uint8_t EnvelopeStage::pedalFade;
+
+// Keeps released keys below the notes being played when the density is high, see NOTE DENSITY
+struct ContrastStage {
+  static uint8_t step, fade, grey, cap;
+  static FORCE_INLINE void begin() {
+    step = contrastOn ? min(density.rate >> 8, DENSITY_STEPS - 1) : 0;
+    fade = pgm_read_byte(&contrastFade[step]);
+    grey = pgm_read_byte(&contrastGrey[step]);
+    cap = pgm_read_byte(&contrastCap[step]);
+    if (cap < 255) cap = scale8(max(density.loudness, (uint8_t)MIN_BRIGHTNESS), cap);
+  }
+  static FORCE_INLINE void apply(CRGB& px, byte i) {
+    if (step == 0 || onLeds[i] || !(px.r | px.g | px.b)) return;
+    if (fade) px.fadeToBlackBy(fade);
+    if (grey) {
+      uint8_t level = px.getAverageLight();
+      nblend(px, CRGB(level, level, level), grey);
+    }
+    uint8_t top = max(px.r, max(px.g, px.b));
+    if (top > cap) px.nscale8(cap * 255 / top);
+  }
+  static FORCE_INLINE void end() {}
+};
+uint8_t ContrastStage::step, ContrastStage::fade, ContrastStage::grey, ContrastStage::cap;
+
+// Estimates the strip current and, with POWER_LIMIT_MA set, dims the knob brightness so this
+// frame stays under it. Runs as its own pass right before show, after all the overlays are drawn.
+struct PowerStage {
+  static uint32_t load;      // sum of all channels
+  static uint16_t milliamps; // last frame at full brightness
+  static FORCE_INLINE void begin() { load = 0; }
+  static FORCE_INLINE void apply(CRGB& px, byte) { load += px.r + px.g + px.b; }
+  static FORCE_INLINE void end() {
+    uint32_t channelMa = load * MA_PER_CHANNEL / 255;
+    milliamps = channelMa + NUM_LEDS * MA_IDLE_PER_LED;
+    if (!POWER_LIMIT_MA) return;
+    uint32_t budget = POWER_LIMIT_MA > NUM_LEDS * MA_IDLE_PER_LED ? POWER_LIMIT_MA - NUM_LEDS * MA_IDLE_PER_LED : 0;
+    if (channelMa * potBrightness / 255 > budget) FastLED.setBrightness(max(budget * 255 / channelMa, (uint32_t)1));
+    else FastLED.setBrightness(potBrightness);
+  }
+};
+uint32_t PowerStage::load;
+uint16_t PowerStage::milliamps;
+
+typedef Pipeline<ExpireStage, EnvelopeStage, ContrastStage> NoteFrame;
+typedef Pipeline<PowerStage> PowerPass;
+
+// TRACING
+// With TRACING enabled, TRACE_BEGIN/TRACE_END mark spans (note events, frames, strip output,
+// network reads, telnet, EEPROM and file reads) in a ring of 8-byte entries stamped with the CPU
+// cycle counter, a dozen cycles each. Averages hide the one frame that glitched, the trace doesn't:
+// recording stops by itself after a frame over TRACE_FREEZE_US so that frame stays in the ring.
+// "trace" dumps the ring as Chrome trace-event JSON, paste it into a .json file and open it in
+// ui.perfetto.dev or chrome://tracing. "trace clear" starts recording again.
+// With TRACING false the macros are empty and the ring isn't built.
+#define TRACING false
+#define TRACE_SIZE 256          // entries, power of two (2 KB)
+#define TRACE_FREEZE_US 20000
+#define TRACE_END_BIT 0x80
+
+enum TraceSpan : uint8_t {
+  TRACE_EVENT,      // handleEvent, arg = note or controller
+  TRACE_FRAME,      // note modes frame, arg = mode
+  TRACE_PASSIVE,    // passive pattern frame, arg = pattern
+  TRACE_SHOW,       // FastLED.show
+  TRACE_NETWORK,    // network MIDI reads
+  TRACE_TELNET,     // RemoteDebug and the visualizer
+  TRACE_EEPROM,     // EEPROM commit, arg = address
+  TRACE_FILE,       // LittleFS read, arg = song block
+  TRACE_SPANS
+};
+const char traceNames[TRACE_SPANS][8] PROGMEM = {
+  "event", "frame", "passive", "show", "network", "telnet", "eeprom", "file"
+};
+
+#if TRACING
+struct TraceEntry {
+  uint32_t cycles;
+  uint8_t span;            // TraceSpan, TRACE_END_BIT set on the end of the span
+  uint8_t reserved;
+  uint16_t arg;
+};
+TraceEntry traceRing[TRACE_SIZE];
+uint16_t traceHead;
+uint16_t traceFilled;      // entries worth reading, stops at TRACE_SIZE while traceHead keeps wrapping
+bool traceFrozen;
+
+struct Trace {
+  static FORCE_INLINE void mark(uint8_t span, uint16_t arg) {
+    if (traceFrozen) return;
+    TraceEntry& t = traceRing[traceHead++ & (TRACE_SIZE - 1)];
+    if (traceFilled < TRACE_SIZE) traceFilled++;
+    t.cycles = ESP.getCycleCount();
+    t.span = span;
+    t.arg = arg;
+  }
+};
+#define TRACE_BEGIN(span, arg) Trace::mark((span), (arg))
+#define TRACE_END(span) Trace::mark((span) | TRACE_END_BIT, 0)
+#else
+#define TRACE_BEGIN(span, arg)
+#define TRACE_END(span)
+#endif
+
+// SWAR KERNELS
+// The ESP8266 has no SIMD, but one 32-bit multiply scales two bytes at once when they sit in
+// 16-bit lanes (mask 0x00FF00FF). Whole-array fades and blends treat r, g and b alike, so the
+// kernels walk the pixels as bytes, a word at a time once aligned, and give exactly what
+// nscale8/blend8 give. "kernels scalar|swar" switches at runtime, "kernels check" compares
+// both on random data (and checks that MidiEvent fields round-trip).
+#define SWAR_LANES 0x00FF00FFUL
+#define KERNEL_CHECK_PIXELS 301   // odd, so every alignment and tail gets tested
+
+typedef void (*FadeKernel)(CRGB* px, uint16_t n, uint8_t fadeBy);
+typedef void (*BlendKernel)(CRGB* dst, const CRGB* src, uint16_t n, fract8 amountOfSrc);
+
+FadeKernel fadeKernel;
+BlendKernel blendKernel;
+bool swarKernels = true;
+
+// NEXT NOTE PREDICTION
+// An order-2 note model: the last two pitches hash into NGRAM_SLOTS slots, each keeping the two
+// most frequent next pitches with small counters (the weaker one decays when something else
+// follows, so a practice piece takes over quickly). Learning and lookup are one slot each per
+// note. With "predict on" the likely next keys glow faintly in the current note's colour, so the
+// frame cadence and strip latency are already paid for when the key is pressed.
+// "predict" reports hit rates and memory.
+#define PREDICTION true
+#define NGRAM_SLOTS 512           // power of two, 4 bytes each
+#define PREWARM_LEVEL 28
+#define PREWARM_MIN_COUNT 2       // only keys that followed this context at least twice
+
+struct NgramSlot {
+  uint8_t next[2];
+  uint8_t count[2];
+};
+
+NgramSlot ngram[NGRAM_SLOTS];
+uint8_t ngramPrev[2];             // last two pitches, oldest first
+uint8_t predicted[2];             // pitches predicted for the next note, 0 = none
+bool predictOn = false;
+uint32_t predictNotes, predictTop1, predictTop2;
+
+// SCORE FOLLOWING
+// "follow on" tracks where the player is in the stored song and keeps the next FOLLOW_AHEAD
+// notes of the score lit. Matching is a dynamic time warping over a window of FOLLOW_WINDOW
+// score positions around the current one (play the next note, skip one, or an extra note), so
+// every note costs the same however long the song is. Skipped or repeated bars break the local
+// match: when FOLLOW_LOST of the last 4 notes didn't match, the follower scans the whole song for
+// the last FOLLOW_CONTEXT notes played, FOLLOW_SCAN positions per note. "follow test" runs simulated performances
+// against the song and reports tracking accuracy and cycles per note.
+#define FOLLOW_WINDOW 16
+#define FOLLOW_BACK 4            // window positions kept behind the current one
+#define FOLLOW_AHEAD 3
+#define FOLLOW_LOST 2
+#define FOLLOW_CONTEXT 4
+#define FOLLOW_SCAN 32
+#define FOLLOW_LEVEL 48
+#define COST_MISMATCH 4
+#define COST_SKIP 3
+#define COST_EXTRA 3
+#define COST_INF 255
+
+// Ode to Joy, melody only
+const uint8_t builtinSong[] PROGMEM = {
+  64, 64, 65, 67, 67, 65, 64, 62, 60, 60, 62, 64, 64, 62, 62,
+  64, 64, 65, 67, 67, 65, 64, 62, 60, 60, 62, 64, 62, 60, 60,
+  62, 62, 64, 60, 62, 64, 65, 64, 60, 62, 64, 65, 64, 62, 60, 62, 55,
+  64, 64, 65, 67, 67, 65, 64, 62, 60, 60, 62, 64, 62, 60, 60
+};
+
+struct FollowState {
+  uint16_t pos;                  // index of the next expected score note
+  uint16_t winStart;             // score position of cost[0]
+  uint8_t cost[FOLLOW_WINDOW];   // cost of "next expected is winStart + k"
+  uint8_t recent[FOLLOW_CONTEXT]; // last pitches played, oldest first
+  uint8_t misses;                // unmatched flags of the last 4 notes, newest in bit 0
+  bool scanning;
+  uint16_t scanPos;
+};
+
+FollowState follow;
+bool followOn = false;
+
+// SONG FILES
+// tools/song_compile.py turns a Standard MIDI File into /song.pls on LittleFS: tracks merged,
+// tempo map applied (absolute ms), notes tagged with channel and hand, plus a bar index. The
+// device never parses MIDI, and starting or seeking is one index read and one event read, both
+// through a 2-block cache. Without a song file the follower uses the built-in melody.
+// "song bar <n>" moves the follower, "loop <a> <b>" repeats bars a to b-1.
+#define SONG_FILE "/song.pls"
+#define SONG_MAGIC 0x31534C50UL    // "PLS1"
+#define SONG_BLOCK 256
+#define SONG_CACHE_BLOCKS 2
+#define SONG_NO_BLOCK 0xFFFF
+
+enum SongHand : uint8_t { HAND_UNKNOWN, HAND_RIGHT, HAND_LEFT };
+
+struct SongHeader {
+  uint32_t magic;
+  uint16_t eventCount;
+  uint16_t indexCount;
+  uint16_t barsPerIndex;
+  uint16_t reserved;
+  uint32_t durationMs;
+};
+
+struct SongIndexEntry {
+  uint32_t ms;
+  uint16_t event;                  // first event of the bar
+  uint16_t bar;
+};
+
+struct SongEvent {
+  uint32_t ms;
+  uint8_t pitch;
+  uint8_t velocity;
+  uint8_t tag;                     // channel in bits 0-3, SongHand in bits 4-5
+  uint8_t duration;                // 16 ms units
+
+  uint8_t channel() const { return (tag & 0x0F) + 1; }
+  uint8_t hand() const { return (tag >> 4) & 3; }
+};
+
+struct SongCacheBlock {
+  uint16_t block;
+  uint8_t data[SONG_BLOCK];
+};
+
+File songFile;
+SongHeader song;
+bool songLoaded = false;
+SongCacheBlock songCache[SONG_CACHE_BLOCKS];
+byte songCacheLast;                // most recently used block
+uint32_t songCacheHits, songCacheMisses;
+uint16_t loopStartEvent, loopEndEvent;  // loopEndEvent 0 = no loop
+
+// CUES
+// For shows: /cues.txt on LittleFS describes animations as keyframe timelines, loaded at boot
+// into a fixed pool. A note-on on the cue channel (cue_channel in settings.txt) over network MIDI
+// looks its note up in cueByNote[] and starts a voice; up to CUE_VOICES cues play at once, added
+// on top of whatever the strip shows. Between keyframes the span and the colour are interpolated.
+// The same note again restarts the cue, Control Change 123 (all notes off) stops them all.
+// A trigger renders a frame straight away instead of waiting for the next one. "cues" lists
+// the pool and the trigger-to-show latency, "cues test" fires every cue and measures it.
+#define CUES true
+#define CUES_FILE "/cues.txt"
+#define CUE_COUNT 32
+#define CUE_KEYFRAMES 256
+#define CUE_VOICES 4
+#define CUE_NONE 0xFF
+#define FRAME_MS 40
+
+struct CueKeyframe {
+  uint16_t ms;                     // from the start of the cue
+  uint8_t first, last;             // LED span
+  CRGB color;
+  uint8_t reserved;
+};
+
+struct Cue {
+  uint16_t keyframe;               // first keyframe in the pool
+  uint8_t count;
+  bool loop;
+};
+
+struct CueVoice {
+  uint8_t cue;                     // CUE_NONE = idle
+  uint8_t segment;                 // keyframe the voice is past
+  bool shown;                      // first frame with it has been shown
+  uint32_t startMs;
+  uint32_t triggerUs;
+};
+
+CueKeyframe cueKeyframes[CUE_KEYFRAMES];
+Cue cues[CUE_COUNT];
+uint8_t cueByNote[128];
+byte cueCount;
+uint16_t cueKeyframeCount;
+CueVoice cueVoices[CUE_VOICES];
+CRGB cueUnder[NUM_LEDS];           // the frame under the cues, put back after show
+bool cueDrawn = false;             // cues are drawn into leds right now
+bool cueLit = false;               // the last frame shown had cues in it
+bool frameDue = false;             // render a frame in this loop
+uint32_t cueTriggers, cueLatencyMax, cueLatencyTotal;
+
+// NOISE FIELD
+// Lava, water and aurora are 2D gradient noise in 8.8 fixed point, x along the strip and y in time,
+// summed over NOISE_OCTAVES octaves. The coarse octaves change slowly, so they're sampled once per
+// NOISE_PERIOD_MS into a snapshot (built a slice per frame) and each frame blends the last two
+// snapshots; only the finest octave is computed for every pixel each frame.
+// They're passive patterns in mode 1 and, with "background lava|water|aurora" over telnet, a dim
+// layer under the notes in the other modes. "bench" compares the field with FastLED's inoise8.
+#define NOISE_OCTAVES 4
+#define NOISE_PERIOD_MS 320
+#define BACKGROUND_LEVEL 48
+
+enum NoiseLookId : uint8_t { NOISE_LAVA, NOISE_WATER, NOISE_AURORA, NOISE_LOOKS, NOISE_OFF = 0xFF };
+
+// Coarsest octave, in lattice steps (8.8): per LED and per second
+struct NoiseLook {
+  uint16_t scale;
+  uint16_t speed;
+};
+const NoiseLook noiseLooks[NOISE_LOOKS] = { {10, 80}, {16, 120}, {6, 50} };
+const char noiseLookNames[NOISE_LOOKS][7] PROGMEM = { "lava", "water", "aurora" };
+
+DEFINE_GRADIENT_PALETTE( GP_Aurora ) {
+    0,   0,   0,   0,
+   70,   0,  40,  10,
+  120,  10, 200,  60,
+  160,  20, 160, 140,
+  200,  90,  20, 150,
+  255,   0,   0,   0 };
+
+struct Noise {
+  static FORCE_INLINE uint8_t hash(uint16_t x, uint16_t y) {
+    uint32_t h = (x * 0x9E3779B1UL) ^ (y * 0x85EBCA77UL);
+    h ^= h >> 15;
+    return (h * 0x2C1B3C6DUL) >> 24;
+  }
+  // Dot product of the offset with one of 8 gradients
+  static FORCE_INLINE int16_t grad(uint8_t h, int16_t dx, int16_t dy) {
+    switch (h & 7) {
+      case 0: return dx + dy;
+      case 1: return dy - dx;
+      case 2: return dx - dy;
+      case 3: return -dx - dy;
+      case 4: return dx;
+      case 5: return -dx;
+      case 6: return dy;
+      default: return -dy;
+    }
+  }
+  static FORCE_INLINE int16_t ease(int16_t f) { return (uint32_t)f * f * (768 - 2 * f) >> 16; }  // smoothstep, 0-255
+  // About -256..256
+  static FORCE_INLINE int16_t gradient(uint32_t x, uint32_t y) {
+    uint16_t xi = x >> 8, yi = y >> 8;
+    int16_t fx = x & 0xFF, fy = y & 0xFF;
+    int16_t n00 = grad(hash(xi, yi), fx, fy);
+    int16_t n10 = grad(hash(xi + 1, yi), fx - 256, fy);
+    int16_t n01 = grad(hash(xi, yi + 1), fx, fy - 256);
+    int16_t n11 = grad(hash(xi + 1, yi + 1), fx - 256, fy - 256);
+    int16_t u = ease(fx), v = ease(fy);
+    int16_t a = n00 + ((int32_t)(n10 - n00) * u >> 8);
+    int16_t b = n01 + ((int32_t)(n11 - n01) * u >> 8);
+    return a + ((int32_t)(b - a) * v >> 8);
+  }
+  // Octaves first..last-1 at LED i, each twice the frequency and half the amplitude of the previous
+  static FORCE_INLINE int16_t octaves(byte first, byte last, byte i, uint16_t scale, uint32_t y) {
+    int16_t sum = 0;
+    for (byte k = first; k < last; k++) sum += gradient(((uint32_t)i * scale << k) + k * 0x3300, (y << k) + k * 0x1700) >> k;
+    return sum;
+  }
+};
+
+int16_t noiseSnapshots[3][NUM_LEDS];  // coarse octaves
+uint8_t noiseFrom, noiseTo, noiseNext;
+uint8_t noiseNextBuilt;               // pixels of the next snapshot done
+uint32_t noiseFromMs, noiseFromY;
+uint8_t noiseLookId = NOISE_OFF;
+uint8_t noiseValue[NUM_LEDS];         // the field this frame, palette index
+CRGBPalette16 noisePalette;
+uint8_t backgroundLook = NOISE_OFF;
+
+MidiEvent eventQueue[EVENT_QUEUE_SIZE];
+byte eventHead = 0, eventTail = 0;
+byte eventQueueMaxDepth;
+uint16_t eventMaxLatencyMs;
+uint32_t eventsDropped;
+
+// INSTANT REPLAY
+// Every live note and controller goes into a ring of 4-byte delta-timed events, REPLAY_EVENTS
+// of them (4 KB, a few minutes of playing). Events keep their channel and source, so they replay
+// down the same path they came in by: serial or network notes, and network cues. "replay" over telnet or holding the on/off button
+// plays back the last REPLAY_SECONDS through the event queue, at REPLAY_SLOW_PERCENT with
+// "replay slow". Live input is dropped while replaying unless REPLAY_OVERLAY_LIVE is set,
+// and never recorded. Pauses longer than 4 s are shortened to 4 s.
+#define REPLAY_EVENTS 1024
+#define REPLAY_SECONDS 20
+#define REPLAY_SLOW_PERCENT 50
+#define REPLAY_OVERLAY_LIVE false
+#define REPLAY_MAX_DELTA 0xFFF
+
+// delta ms (12) | control change (1) | source (1) | channel (4) | index (7) | value (7)
+// Value is the velocity for notes, 0 for a note off.
+typedef uint32_t ReplayEvent;
+
+ReplayEvent replayRing[REPLAY_EVENTS];
+uint16_t replayNewest;      // slot of the last recorded event
+uint16_t replayCount;
+uint32_t replayLastMs;      // time of the last recorded event
+bool replaying = false;
+uint16_t replayPos, replayLeft;
+uint32_t replayNextMs;
+uint8_t replaySpeed = 100;  // percent
+
+// NETWORK INPUT LIMITS
+// The serial piano always comes first: it is read until empty (up to SERIAL_READS_PER_LOOP
+// messages) and the network is only read when no serial bytes are waiting, at most
+// WIFI_READS_PER_LOOP messages. Each AppleMIDI peer has a token bucket of WIFI_RATE_PER_S
+// messages per second with bursts of WIFI_BURST, and network events may only fill up to
+// WIFI_QUEUE_SHARE of the event queue, so a flooding DAW can't crowd out the piano.
+// Peers beyond WIFI_PEERS share the last bucket. "net" over telnet prints the counters,
+// "flood" measures serial note latency with and without a simulated network flood.
+#define SERIAL_READS_PER_LOOP 16
+#define WIFI_READS_PER_LOOP 8
+#define WIFI_PEERS 4
+#define WIFI_RATE_PER_S 300
+#define WIFI_BURST 48
+#define WIFI_QUEUE_SHARE (EVENT_QUEUE_SIZE / 2)
+#define FLOOD_PHASE_MS 2000
+#define FLOOD_PER_LOOP 40
+#define FLOOD_NOTE_MS 20
+#define FLOOD_SSRC 0xF100D
+
+struct WifiPeer {
+  uint32_t ssrc;          // 0 = free slot
+  uint32_t tokens;        // thousandths of a message
+  uint32_t refillMs;
+  uint32_t passed, throttled, dropped;
+};
+
+WifiPeer wifiPeers[WIFI_PEERS + 1];  // the last one is shared by unknown peers
+WifiPeer* currentPeer = &wifiPeers[WIFI_PEERS];  // peer of the packet being parsed
+byte wifiQueued;                     // network events in the queue
+
+bool floodTesting = false;
+uint32_t floodPushUs;
+uint32_t floodLatencyMax, floodLatencyTotal, floodLatencyCount;
+
+// TELNET VISUALIZER
+// "viz" over telnet toggles a live view of the strip at the top of the terminal, drawn with ANSI
+// true-colour escapes as a keyboard (black keys on the upper row), with the last frame's render
+// time, the deepest event queue and a sparkline of event latency. Log lines keep scrolling below.
+// Only cells whose colour changed are sent, so a quiet strip costs next to nothing and the view
+// doesn't skew the timings it shows. It shows whatever the strip shows, "replay" plays the
+// recorded history into it.
+#define VIZ_MS 100
+#define VIZ_TOP_ROW 1            // black keys, white keys below, then the status line
+#define VIZ_LOG_ROW (VIZ_TOP_ROW + 4)
+#define SPARK_LEN 32
+#define SPARK_MAX_MS 7           // latency shown as a full bar
+
+bool vizOn = false;
+bool vizFull;                    // next frame redraws everything
+CRGB vizShown[NUM_LEDS];
+uint8_t spark[SPARK_LEN];        // event latency per viz frame, ms
+byte sparkHead;
+uint16_t vizLatency;             // max since the last viz frame
+byte vizQueue;
+uint32_t frameMicros;            // render time of the last frame
+char vizOut[400];
+uint16_t vizLen;
+char vizStatus[48];
+
+// MIDI INPUT
+// The MIDI callbacks only upscale the message into a MidiEvent and queue it,
+// processEvents() later hands the queue to the engine below.
+
+void HOT_PATH OnNoteOn(byte channel, byte pitch, byte velocity) {
+  pushEvent(MidiEvent::note(SRC_SERIAL, UMP_NOTE_ON, channel, pitch, velocity));
+}
+
+void HOT_PATH OnNoteOff(byte channel, byte pitch, byte velocity) { 
+  pushEvent(MidiEvent::note(SRC_SERIAL, UMP_NOTE_OFF, channel, pitch, velocity));
+}
+
+void OnProgramChange(byte channel, byte number) {
+  pushEvent(MidiEvent::program(SRC_SERIAL, channel, number));
+}
+
+void OnControlChange(byte channel, byte number, byte value) {
+  pushEvent(MidiEvent::control(SRC_SERIAL, channel, number, value));
+}
+
+void OnNoteOnWIFI(byte channel, byte pitch, byte velocity) {
+  if (admitWifi()) pushEvent(MidiEvent::note(SRC_WIFI, UMP_NOTE_ON, channel, pitch, velocity));
+}
+
+void OnNoteOffWIFI(byte channel, byte pitch, byte velocity) { 
+  if (admitWifi()) pushEvent(MidiEvent::note(SRC_WIFI, UMP_NOTE_OFF, channel, pitch, velocity));
+}
+
+void OnControlChangeWIFI(byte channel, byte number, byte value) {
+  if (admitWifi()) pushEvent(MidiEvent::control(SRC_WIFI, channel, number, value));
+}
+
+void OnMidiSysEx(byte* data, unsigned length) {
+  debugV("SYSEX: (%s, %i bytes) ", getSysExStatus(data, length).c_str(), length);
+  for (uint16_t i = 0; i < length; i++)
+  {
+    rdebugD("%i", data[i]);
+    rdebugD(" ");
+  }
+  debugD();
+}
+
+String getSysExStatus(const byte* data, uint16_t length)
+{
+  if (data[0] == 0xF0 && data[length - 1] == 0xF7)
+    return "F"; // Full SysEx Command
+  else if (data[0] == 0xF0 && data[length - 1] != 0xF7)
+    return "S"; // Start of SysEx-Segment
+  else if (data[0] != 0xF0 && data[length - 1] != 0xF7)
+    return "M"; // Middle of SysEx-Segment
+  else
+    return "E"; // End of SysEx-Segment
+}
+
+void HOT_PATH pushEvent(const MidiEvent& e) {
+  byte next = (eventTail + 1) % EVENT_QUEUE_SIZE;
+  if (next == eventHead) {
+    eventsDropped++;
+    return;
+  }
+  eventQueue[eventTail] = e;
+  eventTail = next;
+  if (e.source() == SRC_WIFI) wifiQueued++;
+  byte depth = eventQueueDepth();
+  if (depth > eventQueueMaxDepth) eventQueueMaxDepth = depth;
+}
+
+byte eventQueueDepth() {
+  return (eventTail + EVENT_QUEUE_SIZE - eventHead) % EVENT_QUEUE_SIZE;
+}
+
+void HOT_PATH processEvents() {
+  byte depth = eventQueueDepth();
+  if (depth > vizQueue) vizQueue = depth;
+  while (eventHead != eventTail) {
+    MidiEvent e = eventQueue[eventHead];
+    eventHead = (eventHead + 1) % EVENT_QUEUE_SIZE;
+    if (e.source() == SRC_WIFI) wifiQueued--;
+    uint16_t latency = (millis() - e.stamp()) & 0xFFF;
+    if (latency > eventMaxLatencyMs) eventMaxLatencyMs = latency;
+    if (latency > vizLatency) vizLatency = latency;
+    TRACE_BEGIN(TRACE_EVENT, e.index());
+    handleEvent(e);
+    TRACE_END(TRACE_EVENT);
+  }
+}
+
+// NETWORK INPUT LIMITS //
+
+WifiPeer* wifiPeerFor(uint32_t ssrc) {
+  for (byte i = 0; i < WIFI_PEERS; i++) {
+    if (wifiPeers[i].ssrc == ssrc) return &wifiPeers[i];
+  }
+  return &wifiPeers[WIFI_PEERS];
+}
+
+void addWifiPeer(uint32_t ssrc) {
+  WifiPeer* peer = wifiPeerFor(0);  // first free slot
+  if (peer == &wifiPeers[WIFI_PEERS]) return;
+  memset(peer, 0, sizeof(WifiPeer));
+  peer->ssrc = ssrc;
+  peer->tokens = WIFI_BURST * 1000UL;
+  peer->refillMs = millis();
+}
+
+void removeWifiPeer(uint32_t ssrc) {
+  WifiPeer* peer = wifiPeerFor(ssrc);
+  if (peer != &wifiPeers[WIFI_PEERS]) peer->ssrc = 0;
+  if (currentPeer == peer) currentPeer = &wifiPeers[WIFI_PEERS];
+}
+
+// Takes a token from the current peer's bucket, false if the message should be dropped
+bool HOT_PATH admitWifi() {
+  WifiPeer& peer = *currentPeer;
+  uint32_t now = millis();
+  // A full refill takes WIFI_BURST / WIFI_RATE_PER_S seconds, clamp before multiplying so a peer
+  // that was quiet for hours doesn't wrap the product and come back with an empty bucket
+  uint32_t elapsed = min(now - peer.refillMs, (uint32_t)WIFI_BURST * 1000 / WIFI_RATE_PER_S);
+  peer.tokens = min(peer.tokens + elapsed * WIFI_RATE_PER_S, (uint32_t)WIFI_BURST * 1000);
+  peer.refillMs = now;
+  if (peer.tokens < 1000) {
+    peer.throttled++;
+    return false;
+  }
+  peer.tokens -= 1000;
+  if (wifiQueued >= WIFI_QUEUE_SHARE) {
+    peer.dropped++;
+    return false;
+  }
+  peer.passed++;
+  return true;
+}
+
+void readMidiInputs() {
+  enterStage(STAGE_MIDI);
+  for (byte n = 0; n < SERIAL_READS_PER_LOOP && MIDI.read(); n++) {}
+  enterStage(STAGE_MIDI_WIFI);
+  if (Serial.available()) return;  // the piano is still talking, the network can wait
+  TRACE_BEGIN(TRACE_NETWORK, 0);
+  for (byte n = 0; n < WIFI_READS_PER_LOOP && MIDI_WIFI.read(); n++) {}
+  TRACE_END(TRACE_NETWORK);
+}
+
+void printNetworkReport() {
+  debugA("%-10s %8s %9s %8s", "peer", "passed", "throttled", "dropped");
+  for (byte i = 0; i <= WIFI_PEERS; i++) {
+    const WifiPeer& p = wifiPeers[i];
+    if (i < WIFI_PEERS && p.ssrc == 0) continue;
+    debugA("%08x   %8u %9u %8u", i < WIFI_PEERS ? p.ssrc : 0, p.passed, p.throttled, p.dropped);
+  }
+  debugA("Limits: %u/s, burst %u, %u of %u queue slots", WIFI_RATE_PER_S, WIFI_BURST, WIFI_QUEUE_SHARE, EVENT_QUEUE_SIZE);
+}
+
+// Serial note-on to engine latency over a quiet phase and a phase with a network flood
+// from a simulated peer. The flood goes straight to the MIDI_WIFI callbacks, FLOOD_PER_LOOP
+// messages per loop, so it tests the buckets and the queue share, not the read cap.
+void runFloodTest() {
+  addWifiPeer(FLOOD_SSRC);
+  floodTesting = true;
+  for (byte phase = 0; phase < 2; phase++) {
+    floodLatencyMax = floodLatencyTotal = floodLatencyCount = 0;
+    uint32_t start = millis(), lastNote = 0;
+    uint32_t loops = 0;
+    bool on = false;
+    while (millis() - start < FLOOD_PHASE_MS) {
+      if (phase == 1) {
+        currentPeer = wifiPeerFor(FLOOD_SSRC);
+        for (byte k = 0; k < FLOOD_PER_LOOP; k++) OnNoteOnWIFI(1, 60 + k % 24, 100);
+        currentPeer = &wifiPeers[WIFI_PEERS];
+      }
+      if (millis() - lastNote >= FLOOD_NOTE_MS) {
+        lastNote = millis();
+        on = !on;
+        floodPushUs = micros();
+        if (on) OnNoteOn(1, 40, 100); else OnNoteOff(1, 40, 0);
+      }
+      processEvents();
+      showLeds();
+      loops++;
+      yield();
+    }
+    debugA("%s: serial latency %lu us average, %lu us max, %lu loops", phase ? "Flood" : "Quiet",
+           floodLatencyCount ? floodLatencyTotal / floodLatencyCount : 0, floodLatencyMax, loops);
+  }
+  floodTesting = false;
+  const WifiPeer& peer = *wifiPeerFor(FLOOD_SSRC);
+  debugA("Flood peer: passed %u, throttled %u, dropped %u", peer.passed, peer.throttled, peer.dropped);
+  removeWifiPeer(FLOOD_SSRC);
+  releaseAllNotes();
+}
+
+// TELNET VISUALIZER //
+
+void toggleViz() {
+  vizOn = !vizOn;
+  vizLen = 0;
+  if (vizOn) {
+    vizFull = true;
+    // clear, keep the log scrolling below the view
+    vizAppend(PSTR("\033[2J\033[%ur\033[%u;1H"), VIZ_LOG_ROW, VIZ_LOG_ROW);
+  } else {
+    vizAppend(PSTR("\033[r\033[2J\033[H"));
+  }
+  Debug.print(vizOut);
+  Debug.print("\n");
+  vizLen = 0;
+}
+
+void vizAppend(PGM_P format, ...) {
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf_P(vizOut + vizLen, sizeof(vizOut) - vizLen, format, args);
+  va_end(args);
+  if (n > 0) vizLen = min(vizLen + n, (int)sizeof(vizOut) - 1);
+}
+
+// RemoteDebug sends on newline: go back to the log cursor, one line up so the newline lands on it
+void vizFlush() {
+  if (vizLen == 0) return;
+  vizAppend(PSTR("\0338\033[1A"));
+  Debug.print(vizOut);
+  Debug.print("\n");
+  vizLen = 0;
+  vizAppend(PSTR("\0337"));
+}
+
+void drawViz() {
+  if (!vizOn) return;
+  EVERY_N_MILLISECONDS(VIZ_MS) {
+    spark[sparkHead] = min(vizLatency, (uint16_t)255);
+    sparkHead = (sparkHead + 1) % SPARK_LEN;
+    byte queue = vizQueue;
+    vizLatency = 0;
+    vizQueue = 0;
+    if (!Debug.isActive(Debug.ANY)) {
+      vizFull = true;
+      return;
+    }
+    vizLen = 0;
+    vizAppend(PSTR("\0337"));
+
+    // Keys, lowest on the left
+    for (byte k = 0; k < NUM_LEDS; k++) {
+      byte led = NUM_LEDS - 1 - k;
+      if (!vizFull && leds[led] == vizShown[led]) continue;
+      vizShown[led] = leds[led];
+      byte note = (FIRST_KEY + k) % 12;
+      bool black = note == 1 || note == 3 || note == 6 || note == 8 || note == 10;
+      CRGB c = leds[led];
+      if (!c) c = black ? CRGB(25, 25, 25) : CRGB(90, 90, 90);
+      vizAppend(PSTR("\033[%u;%uH\033[38;2;%u;%u;%um\xe2\x96\x88"), VIZ_TOP_ROW + !black, k + 1, c.r, c.g, c.b);
+      if (vizFull) vizAppend(PSTR("\033[%u;%uH "), VIZ_TOP_ROW + black, k + 1);
+      if (vizLen > sizeof(vizOut) - 64) vizFlush();
+    }
+
+    // Status, only when it changed
+    char status[sizeof(vizStatus)];
+    snprintf_P(status, sizeof(status), PSTR("frame %5lu us  queue %2u/%u  latency"), (unsigned long)frameMicros, queue, EVENT_QUEUE_SIZE);
+    bool sparkChanged = spark[(sparkHead + SPARK_LEN - 1) % SPARK_LEN] || spark[(sparkHead + SPARK_LEN - 2) % SPARK_LEN];
+    if (vizFull || sparkChanged || strcmp(status, vizStatus)) {
+      strcpy(vizStatus, status);
+      vizAppend(PSTR("\033[%u;1H\033[0m%s "), VIZ_TOP_ROW + 2, status);
+      for (byte i = 0; i < SPARK_LEN; i++) {
+        byte level = min(spark[(sparkHead + i) % SPARK_LEN], (uint8_t)SPARK_MAX_MS);
+        vizAppend(PSTR("\xe2\x96%c"), 0x81 + level);  // U+2581..2588
+        if (vizLen > sizeof(vizOut) - 16) vizFlush();
+      }
+      vizAppend(PSTR(" %u ms"), SPARK_MAX_MS);
+    }
+    if (vizFull) {
+      vizAppend(PSTR("\033[%u;1H\033[0m"), VIZ_TOP_ROW + 3);
+      for (byte k = 0; k < NUM_LEDS; k++) {
+        vizAppend(PSTR("-"));
+      }
+    }
+    if (vizLen > 2) {  // more than the cursor save
+      vizAppend(PSTR("\033[0m"));
+      vizFlush();
+    }
+    vizLen = 0;
+    vizFull = false;
+  }
+}
+
+// INSTANT REPLAY //
+
+void recordReplay(const MidiEvent& e) {
+  uint32_t now = millis();
+  uint32_t delta = replayCount ? min(now - replayLastMs, (uint32_t)REPLAY_MAX_DELTA) : 0;
+  replayLastMs = now;
+  bool cc = e.status() == UMP_CONTROL_CHANGE;
+  byte value = cc ? e.value7() : e.status() == UMP_NOTE_ON ? e.velocity() >> 9 : 0;
+  replayNewest = (replayNewest + 1) % REPLAY_EVENTS;
+  replayRing[replayNewest] = delta << 20 | (uint32_t)cc << 19 | (uint32_t)(e.source() & 1) << 18
+                           | (uint32_t)(e.channel() - 1) << 14 | (uint32_t)(e.index() & 0x7F) << 7 | (value & 0x7F);
+  if (replayCount < REPLAY_EVENTS) replayCount++;
+}
+
+// All notes off, so the replay starts (and live playing resumes) on a dark strip
+void releaseAllNotes() {
+  memset(onLeds, 0, sizeof(onLeds));
+  memset(fadeLeds, 0, sizeof(fadeLeds));
+  memset(doNotFade, 0, sizeof(doNotFade));
+  memset(heldMask, 0, sizeof(heldMask));
+  spansDirty = true;
+  memset(ringingMask, 0, sizeof(ringingMask));
+  sustain = 0;
+  gesture.type = GESTURE_NONE;
+  FastLED.clear();
+}
+
+void startReplay(uint8_t speed) {
+  // Walk back from the newest event to the first one inside the window
+  uint32_t span = millis() - replayLastMs;
+  uint16_t count = 0, pos = replayNewest;
+  while (count < replayCount && span <= REPLAY_SECONDS * 1000UL) {
+    span += replayRing[pos] >> 20;
+    count++;
+    pos = (pos + REPLAY_EVENTS - 1) % REPLAY_EVENTS;
+  }
+  if (count == 0) {
+    debugW("Replay: nothing played in the last %u s", REPLAY_SECONDS);
+    return;
+  }
+  replayLeft = count;
+  replayPos = (replayNewest + REPLAY_EVENTS - count + 1) % REPLAY_EVENTS;
+  replaySpeed = speed;
+  replayNextMs = millis();
+  replaying = true;
+  releaseAllNotes();
+  debugI("Replay: %u events at %u%%", count, speed);
+}
+
+void stopReplay() {
+  if (!replaying) return;
+  replaying = false;
+  releaseAllNotes();
+  debugI("Replay: done");
+}
+
+// Queues the replay events that are due, the first one plays straight away
+void stepReplay() {
+  while (replaying && (int32_t)(millis() - replayNextMs) >= 0) {
+    ReplayEvent r = replayRing[replayPos];
+    byte source = SRC_REPLAY | ((r >> 18) & 1), channel = ((r >> 14) & 0xF) + 1;
+    byte index = (r >> 7) & 0x7F, value = r & 0x7F;
+    if (r >> 19 & 1) pushEvent(MidiEvent::control(source, channel, index, value));
+    else pushEvent(MidiEvent::note(source, value ? UMP_NOTE_ON : UMP_NOTE_OFF, channel, index, value));
+    replayPos = (replayPos + 1) % REPLAY_EVENTS;
+    if (--replayLeft == 0) {
+      stopReplay();
+      return;
+    }
+    replayNextMs += (replayRing[replayPos] >> 20) * 100 / replaySpeed;
+  }
+}
+
+// ENGINE //
+
+void HOT_PATH handleEvent(const MidiEvent& e) {
+  if (floodTesting && e.source() == SRC_SERIAL && !e.replayed()) {
+    uint32_t latency = micros() - floodPushUs;
+    floodLatencyTotal += latency;
+    floodLatencyCount++;
+    if (latency > floodLatencyMax) floodLatencyMax = latency;
+  }
+  if (!e.replayed() && e.status() != UMP_PROGRAM_CHANGE) {
+    if (replaying) {
+      if (!REPLAY_OVERLAY_LIVE) return;
+    } else if (!floodTesting) {
+      recordReplay(e);
+    }
+  }
+  if (CUES && e.source() == SRC_WIFI && e.channel() == config->cueChannel) {
+    handleCueEvent(e);
+    return;
+  }
+  bool wifi = e.source() == SRC_WIFI;
+  switch (e.status()) {
+    case UMP_NOTE_ON:
+      recordFlight(wifi ? FLIGHT_WIFI_NOTE_ON : FLIGHT_NOTE_ON, e.index(), e.velocity());
+      if (wifi) wifiNoteOn(e); else noteOn(e);
+      break;
+    case UMP_NOTE_OFF:
+      recordFlight(wifi ? FLIGHT_WIFI_NOTE_OFF : FLIGHT_NOTE_OFF, e.index(), e.velocity());
+      if (wifi) wifiNoteOff(e); else noteOff(e);
+      break;
+    case UMP_CONTROL_CHANGE:
+      recordFlight(FLIGHT_CC, e.index(), e.value() >> 16);
+      if (wifi) debugV("WIFI MIDI Control Change: %u %u", e.index(), e.value7());
+      else controlChange(e);
+      break;
+    case UMP_PROGRAM_CHANGE:
+      recordFlight(FLIGHT_PROGRAM, e.index(), e.channel());
+      debugI("MIDI Program Change: %i", e.index());
+      if (PRESET_PROGRAM_CHANGE && e.index() < PRESET_COUNT) applyPreset(e.index(), true);
+      break;
+  }
+}
+
+// LED for a MIDI note, the lowest key is at the end of the strip
+byte noteLed(byte pitch) {
   byte pitchcheck = constrain(pitch,21,108);
-  byte velocitycheck = constrain(velocity,45,100);//constrain(velocity,0,127);
   //byte ld = map(pitchcheck,21,109,NUM_LEDS-1,-1);
-  byte ld = -pitchcheck + NUM_LEDS + 21 -1;
+  return -pitchcheck + NUM_LEDS + 21 -1;
+}
+
+// MIN_BRIGHTNESS..255 over the velocity range VEL_LO..VEL_HI, in fixed point
+uint8_t HOT_PATH velocityBrightness(uint16_t velocity) {
+  velocity = constrain(velocity, VEL_LO, VEL_HI);
+  return MIN_BRIGHTNESS + (((uint32_t)(velocity - VEL_LO) * VEL_BRIGHTNESS_SCALE) >> 16);
+}
+
+// 0..240 palette index over the velocity range
+uint8_t HOT_PATH velocityIndex(uint16_t velocity) {
+  velocity = constrain(velocity, VEL_LO, VEL_HI);
+  return ((uint32_t)(velocity - VEL_LO) * VEL_INDEX_SCALE) >> 16;
+}
+
+void HOT_PATH noteOn(const MidiEvent& e) {
+  lastKeyPress = millis();
+  debugI("Note on: %u, velocity: %u, channel: %u", e.index(), e.velocity(), e.channel());
+  byte ld = noteLed(e.index());
+  uint8_t brightness = velocityBrightness(e.velocity());
   //debugI("Mapped: %s -> %s", String(pitchcheck).c_str(), String(ld).c_str());
-  //byte ld = map(pitchcheck,21,108,0,NUM_LEDS-1);
   onLeds[ld] = true;
+  setKeyBit(heldMask, ld);
+  countNote(brightness);
   if (autoModeOn & (mode==1 || mode==0)) {
     mode = autoMode;
   } 
   autoModeOn = false;
+  if (mode == INTERVAL_MODE) {
+    spansDirty = true;
+    return;
+  }
    switch (mode) {
       case 2: // FIXED COLOR
-        leds[ld].setHSV(customHue, 255, map(velocitycheck,45,100,MIN_BRIGHTNESS,255));//150
+        leds[ld].setHSV(customHue, 255, brightness);//150
         break;
        case 3: // FIXED COLOR - less saturation
-        leds[ld].setHSV(customHue, 150, map(velocitycheck,45,100,MIN_BRIGHTNESS,255));//60
+        leds[ld].setHSV(customHue, 150, brightness);//60
         break;
-       case 4: // PALETTE
-        if (mode4PalIndex==0) {
-          leds[ld] = rainbowPalette[ld];
-          //leds[ld].setHSV(rgb2hsv_approximate(rainbowPalette[ld]).hue, rgb2hsv_approximate(rainbowPalette[ld]).sat, map(velocitycheck,45,100,MIN_BRIGHTNESS,255));
-          leds[ld].fadeLightBy(255 - map(velocitycheck,45,100,MIN_BRIGHTNESS,255) );
-        } else {
-          leds[ld] = ColorFromPalette(mode4Palettes[mode4PalIndex-1],map(pitchcheck,21,108,0,240));
-          //leds[ld].setHSV(rgb2hsv_approximate(leds[ld]).hue, rgb2hsv_approximate(leds[ld]).sat, map(velocitycheck,45,100,MIN_BRIGHTNESS,255));
-          leds[ld].fadeLightBy(255 - map(velocitycheck,45,100,MIN_BRIGHTNESS,255) );
-        }
+       case 4: // PALETTE (keyPalette holds the in-progress morph, if any)
+        leds[ld] = keyPalette[ld];
+        leds[ld].fadeLightBy(255 - brightness);
         break;
        case 5: // VELOCITY 
-        leds[ld] = ColorFromPalette(mode5Palettes[mode5PalIndex],map(velocitycheck,45,100,0,240));
+        leds[ld] = ColorFromPalette(*velocityPalette, velocityIndex(e.velocity()));
         break;
        case 6: // ROTATING HUE
-        leds[ld].setHSV(gHue, customSaturation, map(velocitycheck,45,100,MIN_BRIGHTNESS,255));
+        leds[ld].setHSV(gHue, customSaturation, brightness);
         break;
        case 7: // FADE AROUND NOTE
         int x=1;
-        leds[ld].setHSV(customHue, 255, map(velocitycheck,45,100,MIN_BRIGHTNESS,255));//115
+        leds[ld].setHSV(customHue, 255, brightness);//115
         for(int i = ld+1; i < NUM_LEDS; i++) {
           if(onLeds[i]) continue;
-          if(map(velocitycheck,45,100,MIN_BRIGHTNESS,255)-x*45 <= 100) break;
-          leds[i].setHSV(customHue, 250, map(velocitycheck,45,100,MIN_BRIGHTNESS,255)-x*45);//110
+          if(brightness-x*45 <= 100) break;
+          leds[i].setHSV(customHue, 250, brightness-x*45);//110
           fadeLeds[i] = true;
           x++;
         }
         x = 1;
         for(int i = ld-1; i >= 0; i--) {
           if(onLeds[i]) continue;
-          if(map(velocitycheck,45,100,MIN_BRIGHTNESS,255)-x*45 <= 100) break;
-          leds[i].setHSV(customHue, 250, map(velocitycheck,45,100,MIN_BRIGHTNESS,255)-x*45);//110
+          if(brightness-x*45 <= 100) break;
+          leds[i].setHSV(customHue, 250, brightness-x*45);//110
           fadeLeds[i] = true;
           x++;
         }
         break;
    }
+  if (PREDICTION) predictNext(e.index(), ld);
+  if (followOn) followNote(e.index());
+  if (SYMPATHETIC_RESONANCE && mode >= 2) resonate(ld, brightness);
+  if (GESTURES && mode >= 2) detectGesture(ld);
+  if (VOICE_SWEEPS && sweepsOn && mode >= 2) trackVoice(e.index(), ld);
 }
 
-void OnNoteOff(byte channel, byte pitch, byte velocity) { 
-    byte pitchcheck2 = constrain(pitch,21,108);
-    //byte led = map(pitchcheck2,21,108,0,NUM_LEDS-1);
-    byte led = -pitchcheck2 + NUM_LEDS + 21 -1;
+void HOT_PATH noteOff(const MidiEvent& e) { 
+    byte led = noteLed(e.index());
     onLeds[led] = false;
+    clearKeyBit(heldMask, led);
+    spansDirty = true;
+    if (sustain < 64) clearKeyBit(ringingMask, led);
     
     int x=1;
     for(int i = led+1; i < NUM_LEDS; i++) {
@@ -256,10 +1629,16 @@ void OnNoteOff(byte channel, byte pitch, byte velocity) {
     }
 }
 
-void OnControlChange(byte channel, byte number, byte value) {
-  debugV("MIDI Control Change: %s %s", String(number).c_str(), String(value).c_str());
+void controlChange(const MidiEvent& e) {
+  byte number = e.index();
+  byte value = e.value7();
+  debugV("MIDI Control Change: %u %u", number, value);
  if (number == 64) {
   //sustain
+  if (sustain >= 64 && value < 64) {
+    // dampers back down, only the held strings keep ringing
+    memcpy(ringingMask, heldMask, sizeof(ringingMask));
+  }
   sustain = value;
   /*if (value > 63) {
     sustain = true; 
@@ -278,41 +1657,16 @@ void OnControlChange(byte channel, byte number, byte value) {
  }
 }
 
-void OnMidiSysEx(byte* data, unsigned length) {
-  debugV("SYSEX: (%s, %i bytes) ", getSysExStatus(data, length).c_str(), length);
-  for (uint16_t i = 0; i < length; i++)
-  {
-    rdebugD("%i", data[i]);
-    rdebugD(" ");
-  }
-  debugD();
-}
-
-String getSysExStatus(const byte* data, uint16_t length)
-{
-  if (data[0] == 0xF0 && data[length - 1] == 0xF7)
-    return "F"; // Full SysEx Command
-  else if (data[0] == 0xF0 && data[length - 1] != 0xF7)
-    return "S"; // Start of SysEx-Segment
-  else if (data[0] != 0xF0 && data[length - 1] != 0xF7)
-    return "M"; // Middle of SysEx-Segment
-  else
-    return "E"; // End of SysEx-Segment
-}
-
-void OnNoteOnWIFI(byte channel, byte pitch, byte velocity) {
+void wifiNoteOn(const MidiEvent& e) {
   /*
      * Channel: 1 - right hand (led channel 13)
      * Channel: 2 - left hand (led channel 12)
      * Channel: 10 - metronome 
      */
-  debugI("WiFi note on: %s, velocity: %s, channel: %s", String(pitch).c_str(), String(velocity).c_str(), String(channel).c_str());
-  byte pitchcheck = constrain(pitch,21,108);
-  //byte velocitycheck = constrain(velocity,45,100);//constrain(velocity,0,127);
-  //byte ld = map(pitchcheck,21,109,NUM_LEDS-1,-1);
-  byte ld = -pitchcheck + NUM_LEDS + 21 -1;
-  //debugI("Mapped: %s -> %s", String(pitchcheck).c_str(), String(ld).c_str());
-  //byte ld = map(pitchcheck,21,108,0,NUM_LEDS-1);
+  byte channel = e.channel();
+  byte pitch = e.index();
+  debugI("WiFi note on: %u, velocity: %u, channel: %u", pitch, e.velocity(), channel);
+  byte ld = noteLed(pitch);
   onLeds[ld] = true;
   doNotFade[ld] = true;
   if (autoModeOn & (mode==1 || mode==0)) {
@@ -331,11 +1685,11 @@ void OnNoteOnWIFI(byte channel, byte pitch, byte velocity) {
    }
 }
 
-void OnNoteOffWIFI(byte channel, byte pitch, byte velocity) { 
-  debugI("WiFi note off: %s, velocity: %s, channel: %s", String(pitch).c_str(), String(velocity).c_str(), String(channel).c_str());
-    byte pitchcheck2 = constrain(pitch,21,108);
-    //byte ld = map(pitchcheck2,21,108,0,NUM_LEDS-1);
-    byte ld = -pitchcheck2 + NUM_LEDS + 21 -1;
+void wifiNoteOff(const MidiEvent& e) { 
+  byte channel = e.channel();
+  byte pitch = e.index();
+  debugI("WiFi note off: %u, velocity: %u, channel: %u", pitch, e.velocity(), channel);
+    byte ld = noteLed(pitch);
     onLeds[ld] = false;
     doNotFade[ld] = false;
     if (channel == 10) {
@@ -350,20 +1704,20 @@ void OnNoteOffWIFI(byte channel, byte pitch, byte velocity) {
    }
 }
 
-void OnControlChangeWIFI(byte channel, byte number, byte value) {
-  debugV("WIFI MIDI Control Change: %s %s", String(number).c_str(), String(value).c_str());
-}
-
-
 void setup() {
   delay(2000); // Safety delay
 
+  LittleFS.begin();
+  if (!loadSettings()) memcpy_P(&settingsBuf[0], &defaultSettings, sizeof(Settings));
+
   connectToWiFi();
 
   setUpOTA();
   
   setUpRemoteDebug();
 
+  readStallCapture();
+
   setUpEEPROM();
   
   // MIDI SETUP
@@ -371,19 +1725,27 @@ void setup() {
   MIDI.setHandleNoteOn(OnNoteOn);
   MIDI.setHandleNoteOff(OnNoteOff);
   MIDI.setHandleControlChange(OnControlChange);
+  MIDI.setHandleProgramChange(OnProgramChange);
   MIDI.setHandleSystemExclusive(OnMidiSysEx);
 
   //MIDI_WIFI SETUP
   MIDI_WIFI.begin(MIDI_CHANNEL_OMNI);
   AppleMIDI_WIFI.setHandleConnected([](const APPLEMIDI_NAMESPACE::ssrc_t & ssrc, const char* name) {
     isConnected++;
+    addWifiPeer(ssrc);
+    recordFlight(FLIGHT_SESSION, 1, isConnected);
     debugI("Connected to session %s %i", name, ssrc);
   });
   AppleMIDI_WIFI.setHandleDisconnected([](const APPLEMIDI_NAMESPACE::ssrc_t & ssrc) {
     isConnected--;
+    removeWifiPeer(ssrc);
+    recordFlight(FLIGHT_SESSION, 0, isConnected);
     debugW("Disconnected", ssrc);
     connectToMidiSession();
   });
+  AppleMIDI_WIFI.setHandleStartReceivedMidi([](const APPLEMIDI_NAMESPACE::ssrc_t & ssrc) {
+    currentPeer = wifiPeerFor(ssrc);
+  });
   MIDI_WIFI.setHandleNoteOn(OnNoteOnWIFI);
   MIDI_WIFI.setHandleNoteOff(OnNoteOffWIFI);
   MIDI_WIFI.setHandleControlChange(OnControlChangeWIFI);
@@ -396,26 +1758,27 @@ void setup() {
   pinMode(LED_BUILTIN,OUTPUT); // DEBUG LED
 
   // ROTARY ENCODER SETUP
-  pinMode(button_pin, INPUT_PULLUP); // BUTTON
-  pinMode(clkPin, INPUT_PULLUP);//set clkPin as INPUT
-  pinMode(dtPin, INPUT_PULLUP);
-  pinMode(btnPin, INPUT_PULLUP);
+  setUpInputPins();
 
   
   //fill_solid( leds, NUM_LEDS, CRGB::White);
   //FastLED.show();
 
-  fill_rainbow( rainbowPalette, NUM_LEDS, gHue, 3);
-
+  setUpPresets();
+  setUpResonance();
+  setUpSubpixel();
+  selectKernels(swarKernels);
+  loadSong();
+  loadCues();
 }
 
 void connectToMidiSession() {
   // Initiate the session
-  IPAddress remote(192, 168, 1, 152);
-  debugI("Connecting to MIDI: 192.168.1.152 ...");
+  IPAddress remote(config->midiPeer[0], config->midiPeer[1], config->midiPeer[2], config->midiPeer[3]);
+  debugI("Connecting to MIDI: %s:%u ...", remote.toString().c_str(), config->midiPort);
   //Serial.print(remote);
   //Serial.print(" ...");
-  AppleMIDI_WIFI.sendInvite(remote, DEFAULT_CONTROL_PORT); // port is 5004 by default
+  AppleMIDI_WIFI.sendInvite(remote, config->midiPort); // port is 5004 by default
   //Serial.println();
 }
 
@@ -426,12 +1789,195 @@ void setUpEEPROM() {
   
 }
 
+void setUpPresets() {
+  if (EEPROM.read(PRESET_EEPROM_ADDR) == PRESET_MAGIC) {
+    EEPROM.get(PRESET_EEPROM_ADDR + 1, presets);
+  } else {
+    memcpy_P(presets, factoryPresets, sizeof(presets));
+  }
+  applySettingsToPresets();
+  for (byte i = 1; i < PRESET_COUNT; i++) buildPresetTables(i);
+  applyPreset(0, false); // the mode is restored from EEPROM separately
+}
+
+void applySettingsToPresets() {
+  presets[0].pedalFade = config->pedalFade;
+  presets[0].releaseFade = config->releaseFade;
+  presets[0].holdFade = config->holdFade;
+  buildPresetTables(0);
+}
+
+void buildPresetTables(byte n) {
+  ScenePreset& p = presets[n];
+  p.palette4 = constrain(p.palette4, 0, MODE4_PALETTE_COUNT-1);
+  p.palette5 = constrain(p.palette5, 0, MODE5_PALETTE_COUNT-1);
+  PresetTables& t = presetTables[n];
+  fillKeyColors(t.keyColor, p.palette4);
+  t.velocity = mode5Palette(p.palette5);
+  for (byte s = 0; s <= 80; s++) t.sustainFade[s] = map(s, 0, 80, p.releaseFade, p.pedalFade);
+}
+
+void applyPreset(byte n, bool withMode) {
+  if (morphing) finishPaletteMorph();
+  // Palette edits morphed the active preset's tables, put them back to what it saved
+  if (mode4PalIndex != scene->palette4 || mode5PalIndex != scene->palette5) buildPresetTables(activePreset);
+  activePreset = n;
+  scene = &presets[n];
+  sceneTables = &presetTables[n];
+  keyPalette = presetTables[n].keyColor;
+  velocityPalette = &presetTables[n].velocity;
+  mode4PalIndex = scene->palette4;
+  mode5PalIndex = scene->palette5;
+  idx = (scene->mode == 5) ? mode5PalIndex : mode4PalIndex;
+  customHue = scene->hue;
+  customSaturation = scene->saturation;
+  if (withMode) {
+    mode = scene->mode;
+    autoModeOn = false;
+  }
+  debugI("Preset %i (mode %i)", n, scene->mode);
+}
+
+// Saves the current look, fades from the active preset
+void storePreset(byte n) {
+  presets[n] = presets[activePreset];
+  presets[n].mode = (mode == 0 || mode == 1) ? autoMode : mode;
+  presets[n].palette4 = mode4PalIndex;
+  presets[n].palette5 = mode5PalIndex;
+  presets[n].hue = customHue;
+  presets[n].saturation = customSaturation;
+  buildPresetTables(n);
+  EEPROM.write(PRESET_EEPROM_ADDR, PRESET_MAGIC);
+  EEPROM.put(PRESET_EEPROM_ADDR + 1, presets);
+  TRACE_BEGIN(TRACE_EEPROM, PRESET_EEPROM_ADDR);
+  EEPROM.commit();
+  TRACE_END(TRACE_EEPROM);
+  debugI("Preset %i saved in flash memory", n);
+}
+
+void setUpInputPins() {
+  pinMode(config->pinButton, INPUT_PULLUP); // BUTTON
+  pinMode(config->pinClk, INPUT_PULLUP);//set clkPin as INPUT
+  pinMode(config->pinDt, INPUT_PULLUP);
+  pinMode(config->pinBtn, INPUT_PULLUP);
+}
+
+// Parses SETTINGS_FILE into the inactive buffer, which becomes active on success.
+// Missing keys keep their default value. Values are taken as written apart from the whitespace
+// around them; a # after whitespace starts a comment, so quote values that contain " #".
+bool parseSettingsFile(Settings& out) {
+  memcpy_P(&out, &defaultSettings, sizeof(Settings));
+  File f = LittleFS.open(SETTINGS_FILE, "r");
+  if (!f) return false;
+
+  uint8_t chunk[64];
+  char key[16], value[sizeof(out.wifiPass) + 2];  // room for the quotes
+  byte keyLen = 0, valueLen = 0;
+  bool inValue = false, inComment = false, inQuotes = false;
+  int n;
+  while ((n = f.read(chunk, sizeof(chunk))) > 0) {
+    for (int i = 0; i < n; i++) {
+      char c = chunk[i];
+      if (c == '\n') {
+        key[keyLen] = 0;
+        value[valueLen] = 0;
+        if (inValue) applySetting(out, key, value);
+        keyLen = valueLen = 0;
+        inValue = inComment = inQuotes = false;
+      } else if (inComment || c == '\r') {
+        continue;
+      } else if (!inValue) {
+        if (c == '#') inComment = true;
+        else if (c == '=') inValue = true;
+        else if (c != ' ' && c != '\t' && keyLen < sizeof(key) - 1) key[keyLen++] = c;
+      } else if (valueLen == 0 && (c == ' ' || c == '\t')) {
+        continue;
+      } else if (c == '#' && !inQuotes && (valueLen == 0 || value[valueLen-1] == ' ' || value[valueLen-1] == '\t')) {
+        inComment = true;
+      } else {
+        if (c == '"') inQuotes = !inQuotes;
+        if (valueLen < sizeof(value) - 1) value[valueLen++] = c;
+      }
+    }
+  }
+  key[keyLen] = 0;
+  value[valueLen] = 0;
+  if (inValue) applySetting(out, key, value);
+  f.close();
+  return true;
+}
+
+void applySetting(Settings& out, const char* key, char* value) {
+  byte len = strlen(value);
+  while (len > 0 && (value[len-1] == ' ' || value[len-1] == '\t')) value[--len] = 0;
+  if (len >= 2 && value[0] == '"' && value[len-1] == '"') {
+    memmove(value, value + 1, len - 2);
+    value[len -= 2] = 0;
+  }
+  unsigned long v = strtoul(value, NULL, 10);
+
+  if (!strcmp_P(key, PSTR("wifi_ssid"))) strlcpy(out.wifiSsid, value, sizeof(out.wifiSsid));
+  else if (!strcmp_P(key, PSTR("wifi_pass"))) strlcpy(out.wifiPass, value, sizeof(out.wifiPass));
+  else if (!strcmp_P(key, PSTR("midi_peer"))) {
+    IPAddress ip;
+    if (ip.fromString(value)) for (byte i = 0; i < 4; i++) out.midiPeer[i] = ip[i];
+    else debugW("Settings: bad midi_peer %s", value);
+  }
+  else if (!strcmp_P(key, PSTR("midi_port"))) out.midiPort = v;
+  else if (!strcmp_P(key, PSTR("sleep_timer"))) out.sleepTimer = v;
+  else if (!strcmp_P(key, PSTR("pedal_fade"))) out.pedalFade = v;
+  else if (!strcmp_P(key, PSTR("release_fade"))) out.releaseFade = v;
+  else if (!strcmp_P(key, PSTR("hold_fade"))) out.holdFade = v;
+  else if (!strcmp_P(key, PSTR("pin_clk"))) out.pinClk = v;
+  else if (!strcmp_P(key, PSTR("pin_dt"))) out.pinDt = v;
+  else if (!strcmp_P(key, PSTR("pin_btn"))) out.pinBtn = v;
+  else if (!strcmp_P(key, PSTR("pin_button"))) out.pinButton = v;
+  else if (!strcmp_P(key, PSTR("cue_channel"))) out.cueChannel = v;
+  else debugW("Settings: unknown key %s", key);
+}
+
+bool loadSettings() {
+  unsigned long start = micros();
+  Settings* spare = &settingsBuf[config == &settingsBuf[0] ? 1 : 0];
+  if (!parseSettingsFile(*spare)) return false;
+  config = spare;
+  configParseMicros = micros() - start;
+  return true;
+}
+
+void reloadSettings() {
+  const Settings* old = config;
+  if (!loadSettings()) {
+    debugW("Settings: %s not found, keeping current settings", SETTINGS_FILE);
+    return;
+  }
+  debugI("Settings reloaded in %lu us", configParseMicros);
+
+  setUpInputPins();
+  applySettingsToPresets();
+  if (memcmp(old->midiPeer, config->midiPeer, 4) || old->midiPort != config->midiPort) connectToMidiSession();
+  if (strcmp(old->wifiSsid, config->wifiSsid) || strcmp(old->wifiPass, config->wifiPass)) {
+    // New credentials are used the next time the WiFi connection is made
+    wifiMulti.addAP(config->wifiSsid, config->wifiPass);
+  }
+}
+
+void printSettings() {
+  debugA("Settings (parsed in %lu us)", configParseMicros);
+  debugA("  wifi_ssid = %s", config->wifiSsid);
+  debugA("  midi_peer = %u.%u.%u.%u:%u", config->midiPeer[0], config->midiPeer[1], config->midiPeer[2], config->midiPeer[3], config->midiPort);
+  debugA("  sleep_timer = %u", config->sleepTimer);
+  debugA("  fades = %u %u %u", config->pedalFade, config->releaseFade, config->holdFade);
+  debugA("  pins = clk %u dt %u btn %u button %u", config->pinClk, config->pinDt, config->pinBtn, config->pinButton);
+  debugA("  cue_channel = %u", config->cueChannel);
+}
+
 void getEncoderTurn(void) {
   static int oldA = HIGH;
   static int oldB = HIGH;
   int result = 0;
-  int newA = digitalRead(clkPin);//read the value of clkPin to newA
-  int newB = digitalRead(dtPin);//read the value of dtPin to newB
+  int newA = digitalRead(config->pinClk);//read the value of clkPin to newA
+  int newB = digitalRead(config->pinDt);//read the value of dtPin to newB
   if (newA != oldA || newB != oldB)
   {
     // something has changed
@@ -467,7 +2013,7 @@ void encoderChange(int oldB) {
 }
 
 void connectToWiFi() {
-  wifiMulti.addAP("Dom", "Internet2014$");   // add Wi-Fi networks you want to connect to
+  wifiMulti.addAP(config->wifiSsid, config->wifiPass);   // add Wi-Fi networks you want to connect to
   //Serial.print("Connecting to WiFi...");
   int i = 0;
   while (wifiMulti.run() != WL_CONNECTED) { // Wait for the Wi-Fi to connect
@@ -521,13 +2067,98 @@ void processCmdRemoteDebug() {
   if (lastCmd == "connectMIDI" || lastCmd == "cm") {
 
     connectToMidiSession();
+  } else if (lastCmd == "bench") {
+    runBenchmarks();
+    resetStallClock();
+  } else if (lastCmd == "replay") {
+    startReplay(100);
+  } else if (lastCmd == "replay slow") {
+    startReplay(REPLAY_SLOW_PERCENT);
+  } else if (lastCmd == "replay stop") {
+    stopReplay();
+  } else if (lastCmd == "kernels scalar" || lastCmd == "kernels swar") {
+    selectKernels(lastCmd.endsWith("swar"));
+    debugA("kernels: %s", swarKernels ? "swar" : "scalar");
+  } else if (lastCmd == "kernels check") {
+    checkKernels();
+    checkEvents();
+    resetStallClock();
+  } else if (lastCmd == "predict") {
+    printPredictionReport();
+  } else if (lastCmd == "predict on" || lastCmd == "predict off") {
+    predictOn = lastCmd.endsWith("on");
+    predictNotes = predictTop1 = predictTop2 = 0;
+    printPredictionReport();
+  } else if (lastCmd == "follow on" || lastCmd == "follow off") {
+    followOn = lastCmd.endsWith("on");
+    followAt(0);
+    debugA("Score following %s", followOn ? "on" : "off");
+  } else if (lastCmd == "song") {
+    printSongReport();
+  } else if (lastCmd == "song reload") {
+    loadSong();
+    followAt(0);
+    printSongReport();
+  } else if (lastCmd.startsWith("song bar ")) {
+    seekSongBar(lastCmd.substring(9).toInt());
+  } else if (lastCmd.startsWith("loop ")) {
+    int space = lastCmd.indexOf(' ', 5);
+    setSongLoop(lastCmd.substring(5).toInt(), space > 0 ? lastCmd.substring(space + 1).toInt() : 0);
+  } else if (lastCmd == "voices") {
+    printVoiceReport();
+  } else if (lastCmd == "voices on" || lastCmd == "voices off") {
+    sweepsOn = lastCmd == "voices on";
+    printVoiceReport();
+  } else if (lastCmd == "contrast") {
+    printContrastReport();
+  } else if (lastCmd == "contrast on" || lastCmd == "contrast off") {
+    contrastOn = lastCmd == "contrast on";
+    printContrastReport();
+  } else if (lastCmd.startsWith("background")) {
+    setBackground(lastCmd.substring(11));
+  } else if (lastCmd == "trace") {
+    printTrace();
+  } else if (lastCmd == "trace clear") {
+    clearTrace();
+  } else if (lastCmd == "cues") {
+    printCueReport();
+  } else if (lastCmd == "cues reload") {
+    loadCues();
+    printCueReport();
+  } else if (lastCmd == "cues test") {
+    runCueTest();
+    resetStallClock();
+  } else if (lastCmd == "follow test") {
+    runFollowTest();
+    resetStallClock();
+  } else if (lastCmd == "viz") {
+    toggleViz();
+  } else if (lastCmd == "net") {
+    printNetworkReport();
+  } else if (lastCmd == "flood") {
+    runFloodTest();
+    resetStallClock();
+  } else if (lastCmd == "mem") {
+    printMemoryReport();
+  } else if (lastCmd == "lastReset") {
+    printStallCapture();
+  } else if (lastCmd == "reload") {
+    reloadSettings();
+  } else if (lastCmd == "config") {
+    printSettings();
+  } else if (lastCmd.startsWith("preset ")) {
+    byte n = lastCmd.substring(7).toInt();
+    if (n < PRESET_COUNT) applyPreset(n, true);
+  } else if (lastCmd.startsWith("storePreset ")) {
+    byte n = lastCmd.substring(12).toInt();
+    if (n < PRESET_COUNT) storePreset(n);
   }
   
 }
 void setUpRemoteDebug() {
   Debug.begin("ESP8266");
 
-  String helpCmd = "connectMIDI";
+  String helpCmd = F("connectMIDI\npreset <n>\nstorePreset <n>\nreplay [slow|stop]\nreload\nconfig\nlastReset\nmem\nnet\nflood\nviz\nkernels [scalar|swar|check]\npredict [on|off]\nfollow [on|off|test]\nsong [reload|bar <n>]\nloop <a> <b>|off\ncues [reload|test]\ntrace [clear]\nbackground lava|water|aurora|off\ncontrast [on|off]\nvoices [on|off]\nbench");
   Debug.setHelpProjectsCmds(helpCmd);
   Debug.setCallBackProjectCmds(&processCmdRemoteDebug);
   
@@ -541,39 +2172,65 @@ void setUpRemoteDebug() {
 // List of patterns to cycle through.  Each is defined as a separate function below.
 typedef void (*SimplePatternList[])();
 //SimplePatternList gPatterns = {rainbow, rainbowWithGlitter, confetti, sinelon};
-SimplePatternList gPatterns = {rainbow, confetti, sinelon, bpm, juggle};
+SimplePatternList gPatterns = {rainbow, confetti, sinelon, bpm, juggle, lava, water, aurora};
+
 
+ButtonAction readButton(ButtonState& b, uint8_t pin) {
+  uint32_t now = millis();
+  bool down = digitalRead(pin) == LOW;
+  if (down && !b.down) {
+    b.down = true;
+    b.held = false;
+    b.downMs = now;
+    return BUTTON_NONE;
+  }
+  if (down) {
+    if (b.held || now - b.downMs < BUTTON_HOLD_MS) return BUTTON_NONE;
+    b.held = true;
+    return BUTTON_HOLD;
+  }
+  if (!b.down) return BUTTON_NONE;
+  b.down = false;
+  return !b.held && now - b.downMs >= BUTTON_DEBOUNCE_MS ? BUTTON_TAP : BUTTON_NONE;
+}
 
 void handleInputs() {
    // PROCESS DIGITAL INPUT
  // Button
     const unsigned int lastMode = mode;
-   if (digitalRead(btnPin) == LOW) {
-      delay(500);
+   ButtonAction action = readButton(modeButton, config->pinBtn);
+   if (action == BUTTON_HOLD) {
+      // Held down: next scene preset
+      applyPreset((activePreset + 1) % PRESET_COUNT, true);
+   } else if (action == BUTTON_TAP) {
       if (mode==0) { mode=autoMode; } else {
-        if (mode >= 7) { mode = 1; } else { mode++; }
+        if (mode >= INTERVAL_MODE) { mode = 1; } else { mode++; }
         idx = 0;
         mode4PalIndex = 1;
         mode5PalIndex = 1;
         customHue = 0;
         customSaturation = 255;
       }
-      debugI("Mode: %i", mode);
    }
-   if (digitalRead(button_pin) == LOW) {
-      delay(500);
+   if (action != BUTTON_NONE) debugI("Mode: %i", mode);
+   action = readButton(powerButton, config->pinButton);
+   if (action == BUTTON_HOLD) {
+      // Held down: instant replay, or stop it
+      if (replaying) stopReplay(); else startReplay(100);
+   } else if (action == BUTTON_TAP) {
       if (mode != 0) {
         autoMode = mode;
         mode = 0;
       } else {
         mode = autoMode;
       }
-      debugI("Mode: %i", mode);
    }
+   if (action != BUTTON_NONE) debugI("Mode: %i", mode);
    if (lastMode != mode) {
+      recordFlight(FLIGHT_MODE, mode, lastMode);
       EEPROM.write(0, mode);
-      EEPROM.commit();
-      debugI("Mode saved in flash memory (%i)", mode);
+      modeUnsaved = true;
+      modeChangedMs = millis();
    }
    
  // Potentiometer
@@ -593,72 +2250,190 @@ void handlePaletteChange() {
   if(mode == 4) {
     //int idx = constrain(floor(map(currAnalogRead,80,1024,0,MODE4_PALETTE_COUNT)),0,MODE4_PALETTE_COUNT-1);
     if(mode4PalIndex != idx) {
-      digitalWrite(LED_BUILTIN, HIGH);
       mode4PalIndex = idx;
-      // FILL PALETTE TO PREVIEW (in reverse) //
-      //int incr = floor(255/NUM_LEDS);
-      //int colorIndex = 255;
-      for( uint16_t i = 0; i < NUM_LEDS; i++) { 
-        //leds[i] = ColorFromPalette(mode4Palettes[mode4PalIndex], colorIndex);
-        //colorIndex -= incr;
-        if (mode4PalIndex==0)
-          leds[i] = rainbowPalette[i];
-        else 
-          leds[-(i+FIRST_KEY) + NUM_LEDS + FIRST_KEY -1] = ColorFromPalette(mode4Palettes[mode4PalIndex-1], map(i+FIRST_KEY,FIRST_KEY,108,0,240));
-      }
-      /////
-      delay(100);
-      digitalWrite(LED_BUILTIN, LOW);
+      startPaletteMorph(4);
     }
   } else if (mode == 5)
   {
     //int idx = constrain(floor(map(currAnalogRead,80,1024,0,MODE5_PALETTE_COUNT)),0,MODE5_PALETTE_COUNT-1);
     if(mode5PalIndex != idx) {
-      digitalWrite(LED_BUILTIN, HIGH);
       mode5PalIndex = idx;
-      delay(100);
-      digitalWrite(LED_BUILTIN, LOW);
+      startPaletteMorph(5);
     }
   } else {
     //customHue = map(currAnalogRead,45,1024,0,255);
   }
 }
 
+CRGBPalette16 mode4Palette(uint8_t palIndex) {
+  if (palIndex == 0) return CRGBPalette16(CRGB::Black); // rainbow, see keyColor()
+  return CRGBPalette16((TProgmemRGBGradientPalettePtr)pgm_read_ptr(&mode4Gradients[palIndex-1]));
+}
+
+CRGBPalette16 mode5Palette(uint8_t palIndex) {
+  return CRGBPalette16((TProgmemRGBGradientPalettePtr)pgm_read_ptr(&mode5Gradients[palIndex]));
+}
+
+// Colour of LED `led` in mode 4 palette `palIndex`, `pal` being mode4Palette(palIndex)
+CRGB keyColor(const CRGBPalette16& pal, uint8_t palIndex, byte led) {
+  if (palIndex == 0) return CHSV(led * 3, 240, 255); // same as fill_rainbow(..., 0, 3)
+  byte pitch = NUM_LEDS + FIRST_KEY - 1 - led;
+  return ColorFromPalette(pal, map(pitch,FIRST_KEY,108,0,240));
+}
+
+void fillKeyColors(CRGB* table, uint8_t palIndex) {
+  CRGBPalette16 pal = mode4Palette(palIndex);
+  for (byte i = 0; i < NUM_LEDS; i++) table[i] = keyColor(pal, palIndex, i);
+}
+
+CRGB paletteMorphTarget(byte i) {
+  if (morphMode == 4) return keyColor(morphTargetPalette, mode4PalIndex, i);
+  return morphTargetPalette[i];
+}
+
+void startPaletteMorph(byte forMode) {
+  // A morph of the other table is cut short, it jumps to its target
+  if (morphing && morphMode != forMode) finishPaletteMorph();
+  morphMode = forMode;
+  CRGB* table = (forMode == 4) ? keyPalette : velocityPalette->entries;
+  memcpy(morphFrom, table, (forMode == 4 ? NUM_LEDS : 16) * sizeof(CRGB));
+  morphTargetPalette = (forMode == 4) ? mode4Palette(mode4PalIndex) : mode5Palette(mode5PalIndex);
+  morphPos = 0;
+  morphLastPass = false;
+  morphStart = millis();
+  morphing = true;
+  digitalWrite(LED_BUILTIN, HIGH);
+}
+
+void finishPaletteMorph() {
+  if (morphMode == 4)
+    fillKeyColors(keyPalette, mode4PalIndex);
+  else
+    *velocityPalette = mode5Palette(mode5PalIndex);
+  morphing = false;
+  digitalWrite(LED_BUILTIN, LOW);
+}
+
+// Recomputes the next slice of the table being morphed, called once per frame
+void stepPaletteMorph() {
+  if (!morphing) return;
+  byte count = (morphMode == 4) ? NUM_LEDS : 16;
+  CRGB* table = (morphMode == 4) ? keyPalette : velocityPalette->entries;
+  unsigned long elapsed = millis() - morphStart;
+  fract8 amount = elapsed >= PALETTE_MORPH_MS ? 255 : elapsed * 256 / PALETTE_MORPH_MS;
+  if (morphPos == 0 && amount == 255) morphLastPass = true;
+
+  byte end = constrain(morphPos + PALETTE_MORPH_SLICE, 0, count);
+  CRGB target[PALETTE_MORPH_SLICE];
+  for (byte i = morphPos; i < end; i++) target[i - morphPos] = paletteMorphTarget(i);
+  if (amount == 255) {
+    memcpy(table + morphPos, target, (end - morphPos) * sizeof(CRGB));
+  } else {
+    memcpy(table + morphPos, morphFrom + morphPos, (end - morphPos) * sizeof(CRGB));
+    blendKernel(table + morphPos, target, end - morphPos, amount);
+  }
+  // Preview the palette on the strip, as long as no note holds the LED
+  for (byte i = morphPos; i < end; i++) {
+    if (morphMode == 4 && mode == 4 && !onLeds[i]) leds[i] = table[i];
+  }
+  morphPos = (end >= count) ? 0 : end;
+
+  if (morphPos == 0 && morphLastPass) {
+    morphing = false;
+    digitalWrite(LED_BUILTIN, LOW);
+  }
+}
+
 void updatePatternsAndHues(){
   EVERY_N_MILLISECONDS(20) { if (mode==1) { gHue++; } }
   EVERY_N_MILLISECONDS(50) { if (mode==6) { gHue++; } }
   EVERY_N_SECONDS(20) { if (mode == 1) { nextPattern(); }}
 }
 
-void showLeds() {
-  EVERY_N_MILLISECONDS(40) {
-    if (mode != 1) {
-      for (byte i=0;i < NUM_LEDS; i++) {
-            if (leds[i].getAverageLight() <=0) {//(((leds[i].r==0 && (leds[i].g==0 || leds[i].b==0)) || (leds[i].g==0 && leds[i].b==0)) && leds[i].getAverageLight() <=5  ) {//(leds[i].getAverageLight() <=0) {
-                onLeds[i] = false;
-                fadeLeds[i] = false;
-                leds[i] = CRGB::Black;
-          
-            } else if (!onLeds[i] && !fadeLeds[i]) {
-              if (sustain > 0) {
-                if(!DONT_FADE_NOTES && !doNotFade[i]) 
-                   leds[i].fadeToBlackBy(map(constrain(sustain, 0, 80), 0, 80, NO_PEDAL_STRENGTH, PEDAL_STRENGTH));
-                
-              } else {
-                leds[i].fadeToBlackBy(NO_PEDAL_STRENGTH);
-              }
-            } else {
-              if(!DONT_FADE_NOTES && !doNotFade[i]) 
-                leds[i].fadeToBlackBy(NOTE_HOLD_FADE);
-            }
-      }
+// A pattern frame every 1000/PASSIVE_FPS ms. Not FastLED.delay(): it re-shows the strip while it
+// waits, and by then the cues have been taken off again.
+void showPassive() {
+  static uint32_t lastFrame = 0;
+  uint32_t now = millis();
+  if (now - lastFrame < 1000 / PASSIVE_FPS) return;
+  lastFrame = now;
+  TRACE_BEGIN(TRACE_PASSIVE, gCurrentPatternNumber);
+  gPatterns[gCurrentPatternNumber]();
+  if (CUES) renderCues();
+  PowerPass::run(leds, 0, NUM_LEDS);
+  TRACE_BEGIN(TRACE_SHOW, NUM_LEDS);
+  FastLED.show();
+  TRACE_END(TRACE_SHOW);
+  if (CUES) cuesShown();
+  TRACE_END(TRACE_PASSIVE);
+}
+
+void HOT_PATH showLeds() {
+  static uint32_t lastFrame = 0;
+  uint32_t now = millis();
+  if (now - lastFrame < FRAME_MS && !frameDue) return;
+  lastFrame = now;
+  frameDue = false;
+
+  uint32_t start = micros();
+  TRACE_BEGIN(TRACE_FRAME, mode);
+  stepPaletteMorph();
+  if (mode != INTERVAL_MODE) spansShown = false;
+  if (mode == INTERVAL_MODE) {
+    static uint8_t shownBrightness;
+    if (!spansShown) {
+      fill_solid(leds, NUM_LEDS, CRGB::Black);
+      spanLow = NUM_LEDS;
+      spansShown = spansDirty = true;
+    }
+    if (spansDirty) renderSpans();
+    // cues need every frame while they run, and one more to take them off
+    bool cueFrame = CUES && (cueLit || cuesRunning());
+    if (spansDirty || cueFrame || potBrightness != shownBrightness) {
+      spansDirty = false;
+      shownBrightness = potBrightness;
+      if (CUES) renderCues();
+      PowerPass::run(leds, 0, NUM_LEDS);
       FastLED.show();
+      if (CUES) cuesShown();
     }
+  } else if (mode != 1) {
+    NoteFrame::run(leds, 0, NUM_LEDS);
+    // Mode 0 is off: the notes fade out, nothing new is drawn (cues are fired on purpose, they still are)
+    if (mode != 0) {
+      if (backgroundLook != NOISE_OFF) renderBackground();
+      if (GESTURES) renderGesture();
+      if (VOICE_SWEEPS && sweepsOn) renderSweeps();
+      if (followOn) renderFollow();
+    }
+    if (CUES) renderCues();
+    PowerPass::run(leds, 0, NUM_LEDS);
+    TRACE_BEGIN(TRACE_SHOW, NUM_LEDS);
+    FastLED.show();
+    TRACE_END(TRACE_SHOW);
+    if (CUES) cuesShown();
+  }
+  TRACE_END(TRACE_FRAME);
+  frameMicros = micros() - start;
+#if TRACING
+  if (frameMicros > TRACE_FREEZE_US && !traceFrozen) {
+    traceFrozen = true;
+    debugW("Frame took %lu us, trace frozen", frameMicros);
   }
+#endif
+}
+
+void commitMode() {
+  if (!modeUnsaved || millis() - modeChangedMs < MODE_COMMIT_MS) return;
+  modeUnsaved = false;
+  TRACE_BEGIN(TRACE_EEPROM, 0);
+  EEPROM.commit();
+  TRACE_END(TRACE_EEPROM);
+  debugI("Mode saved in flash memory (%i)", mode);
 }
 
 void sleepMode() {
-  if (!autoModeOn && millis() - lastKeyPress > SLEEP_TIMER*1000 && mode!=0) {
+  if (!autoModeOn && millis() - lastKeyPress > config->sleepTimer*1000UL && mode!=0) {
     autoModeOn = true;
     autoMode = mode;
     mode = 1;
@@ -670,32 +2445,1464 @@ void sleepMode() {
 }
 
 void loop() {
+  loopStarted();
  
+  enterStage(STAGE_OTA);
   ArduinoOTA.handle();
 
   //Set brightness
-  FastLED.setBrightness(map(currAnalogRead, 0, 1024, 1, 255));
+  potBrightness = map(currAnalogRead, 0, 1024, 1, 255);
+  FastLED.setBrightness(potBrightness);
    
+  enterStage(STAGE_INPUTS);
   handleInputs();
  
+  enterStage(STAGE_PALETTE);
   handlePaletteChange();
  
-   MIDI.read();
-   MIDI_WIFI.read();
+  readMidiInputs();
+
+  enterStage(STAGE_EVENTS);
+  stepReplay();
+  processEvents();
+  decayDensity();
    
    if (mode == 1) { 
-      gPatterns[gCurrentPatternNumber](); 
-      FastLED.show(); 
-      FastLED.delay(1000/PASSIVE_FPS); 
+      enterStage(STAGE_PASSIVE);
+      showPassive();
    }
 
+  enterStage(STAGE_PATTERNS);
   updatePatternsAndHues();
 
   sleepMode();
 
+  enterStage(STAGE_SHOW);
   showLeds();
 
+  enterStage(STAGE_DEBUG);
+  TRACE_BEGIN(TRACE_TELNET, 0);
   Debug.handle();
+  drawViz();
+  TRACE_END(TRACE_TELNET);
+
+  enterStage(STAGE_IDLE);
+  commitMode();
+}
+
+// STALL DETECTOR //
+
+void recordFlight(uint8_t kind, uint8_t a, uint16_t b) {
+  FlightEntry& e = flight[flightHead];
+  e.ms = millis();
+  e.kind = kind;
+  e.a = a;
+  e.b = b;
+  flightHead = (flightHead + 1) % FLIGHT_SIZE;
+}
+
+void enterStage(uint8_t stage) {
+  unsigned long now = micros();
+  unsigned long spent = now - stageStartMicros;
+  if (currentStage != STAGE_IDLE && spent > stageBudgetMs[currentStage] * 1000UL) {
+    stageOverruns[currentStage]++;
+    recordFlight(FLIGHT_OVERRUN, currentStage, min(spent / 1000, 65535UL));
+  }
+  currentStage = stage;
+  stageStartMicros = now;
+}
+
+// After a self-test that blocked the loop on purpose: the loop and stage clocks start over, so
+// it isn't captured as a stall or counted as an overrun
+void resetStallClock() {
+  loopStartMillis = 0;
+  loopStartMicros = micros();
+  stageStartMicros = loopStartMicros;
+}
+
+void loopStarted() {
+  unsigned long now = millis();
+  if (loopStartMillis != 0 && now - loopStartMillis > STALL_LOOP_MS) {
+    // The previous loop stalled but recovered before the watchdog fired
+    recordFlight(FLIGHT_STALL, 0, min(now - loopStartMillis, 65535UL));
+    debugW("Loop stalled for %lu ms", now - loopStartMillis);
+    saveStallCapture(0xFF);
+  }
+  loopStartMillis = now;
+
+  unsigned long nowMicros = micros();
+  if (loopCount++ > 0) {
+    unsigned long spent = nowMicros - loopStartMicros;
+    loopMicrosTotal += spent;
+    if (spent > loopMicrosMax) loopMicrosMax = spent;
+  }
+  loopStartMicros = nowMicros;
+}
+
+// Free heap and loop timing, to compare builds (e.g. HOT_PATH_IN_IRAM true/false)
+void printMemoryReport() {
+  debugA("Free heap: %u bytes, largest block %u, fragmentation %u%%", ESP.getFreeHeap(), ESP.getMaxFreeBlockSize(), ESP.getHeapFragmentation());
+  debugA("Free stack (lowest): %u bytes", ESP.getFreeContStack());
+  debugA("Sketch: %u bytes, free %u bytes", ESP.getSketchSize(), ESP.getFreeSketchSpace());
+  if (loopCount > 1) debugA("Loop: %lu us average, %lu us max over %lu loops", loopMicrosTotal / (loopCount - 1), loopMicrosMax, loopCount - 1);
+  debugA("Events: queue max %u/%u, max wait %u ms, dropped %u", eventQueueMaxDepth, EVENT_QUEUE_SIZE, eventMaxLatencyMs, eventsDropped);
+  debugA("Strip: ~%u mA at full brightness, limit %u mA", PowerStage::milliamps, POWER_LIMIT_MA);
+  loopCount = loopMicrosTotal = loopMicrosMax = 0;
+  eventQueueMaxDepth = 0;
+  eventMaxLatencyMs = 0;
+}
+
+void saveStallCapture(uint32_t reason) {
+  StallCapture c;
+  c.magic = STALL_MAGIC;
+  c.uptimeMs = millis();
+  c.reason = reason;
+  c.stage = currentStage;
+  c.serialQueue = min(Serial.available(), 255);
+  c.eventQueue = eventQueueDepth();
+  c.reserved = 0;
+  c.stageMs = min((micros() - stageStartMicros) / 1000, 65535UL);
+  c.stackFree = ESP.getFreeContStack();
+  for (byte i = 0; i < 8; i++) c.recent[i] = flight[(flightHead + FLIGHT_SIZE - 8 + i) % FLIGHT_SIZE];
+  ESP.rtcUserMemoryWrite(STALL_RTC_OFFSET, (uint32_t*)&c, sizeof(c));
+}
+
+// Called by the ESP8266 core before it restarts after an exception or a soft WDT reset
+extern "C" void custom_crash_callback(struct rst_info* rst_info, uint32_t stack, uint32_t stack_end) {
+  saveStallCapture(rst_info->reason);
+}
+
+const char* stageName(uint8_t stage) {
+  static char name[sizeof(stageNames[0])];
+  strncpy_P(name, stageNames[stage % STAGE_COUNT], sizeof(name));
+  return name;
+}
+
+void readStallCapture() {
+  ESP.rtcUserMemoryRead(STALL_RTC_OFFSET, (uint32_t*)&lastStall, sizeof(lastStall));
+  lastStallValid = lastStall.magic == STALL_MAGIC;
+  if (!lastStallValid) return;
+  uint32_t cleared = 0;
+  ESP.rtcUserMemoryWrite(STALL_RTC_OFFSET, &cleared, sizeof(cleared)); // report it only once
+  debugW("Previous run stopped in stage %s", stageName(lastStall.stage));
+}
+
+void printStallCapture() {
+  debugA("Reset reason: %s", ESP.getResetReason().c_str());
+  debugA("Stage overruns:");
+  for (byte i = 1; i < STAGE_COUNT; i++) {
+    if (stageOverruns[i]) debugA("  %s: %u", stageName(i), stageOverruns[i]);
+  }
+  if (!lastStallValid) {
+    debugA("No stall captured before this boot");
+    return;
+  }
+  debugA("Captured at %lu ms, reason %lu, stage %s (%u ms in it)", lastStall.uptimeMs, lastStall.reason,
+         stageName(lastStall.stage), lastStall.stageMs);
+  debugA("Serial queue: %u bytes, event queue: %u, free stack: %u bytes", lastStall.serialQueue, lastStall.eventQueue, lastStall.stackFree);
+  for (byte i = 0; i < 8; i++) {
+    const FlightEntry& e = lastStall.recent[i];
+    if (e.kind) debugA("  %lu ms: kind %u, %u, %u", e.ms, e.kind, e.a, e.b);
+  }
+}
+
+// NOTE DENSITY //
+
+// Called from the loop, the density has to fall in mode 1 and mode 8 as well
+void decayDensity() {
+  uint16_t elapsed = (uint16_t)millis() - density.decayMs;
+  if (elapsed < DENSITY_DECAY_MS) return;
+  density.decayMs += elapsed;
+  density.rate -= min((uint32_t)density.rate * elapsed >> DENSITY_TAU_SHIFT, (uint32_t)density.rate);
+}
+
+void countNote(uint8_t brightness) {
+  density.rate = min(density.rate + DENSITY_PER_NOTE, 0xFFFF);
+  density.loudness += ((int16_t)brightness - density.loudness) >> 3;
+}
+
+void printContrastReport() {
+  debugA("Contrast %s: %u.%02u notes/s, loudness %u", contrastOn ? "on" : "off",
+         density.rate >> 8, (density.rate & 0xFF) * 100 / 256, density.loudness);
+  debugA("  released keys: fade +%u, grey %u, at most %u", ContrastStage::fade, ContrastStage::grey, ContrastStage::cap);
+}
+
+// SYMPATHETIC RESONANCE //
+
+void setUpResonance() {
+  memset(resonanceWeight, 0, sizeof(resonanceWeight));
+  memset(overtoneMask, 0, sizeof(overtoneMask));
+  for (byte h = 0; h < HARMONIC_COUNT; h++) {
+    byte offset = pgm_read_byte(&harmonicOffsets[h]);
+    resonanceWeight[offset] = pgm_read_byte(&harmonicWeights[h]);
+    // higher pitch is a lower LED index
+    for (byte led = offset; led < NUM_LEDS; led++) setKeyBit(overtoneMask[led], led - offset);
+  }
+}
+
+void setKeyBit(uint32_t* mask, byte led) {
+  mask[led >> 5] |= 1UL << (led & 31);
+}
+
+void clearKeyBit(uint32_t* mask, byte led) {
+  mask[led >> 5] &= ~(1UL << (led & 31));
+}
+
+// Called for every note-on after it has been drawn, leds[led] has the note colour
+void resonate(byte led, uint8_t brightness) {
+  if (sustain >= 64) {
+    CRGB color = leds[led];
+    for (byte w = 0; w < KEY_WORDS; w++) {
+      uint32_t hits = overtoneMask[led][w] & ringingMask[w];
+      while (hits) {
+        byte bit = __builtin_ctz(hits);
+        hits &= hits - 1;
+        byte other = w * 32 + bit;
+        CRGB glow = color;
+        glow.nscale8(scale8(resonanceWeight[led - other], scale8(brightness, RESONANCE_LEVEL * 2)));
+        leds[other] += glow;
+      }
+    }
+  }
+  setKeyBit(ringingMask, led);
+}
+
+// SUB-PIXEL DRAWING //
+
+void setUpSubpixel() {
+  for (byte p = 0; p < SUBPIXEL_PHASES; p++) {
+    int16_t offset = p * (256 / SUBPIXEL_PHASES) + (128 / SUBPIXEL_PHASES) - 128;  // from the nearest LED
+    for (byte t = 0; t < 3; t++) {
+      uint16_t d = abs(offset - (t - 1) * 256);
+      // (1 + cos(2 pi d / 3 LEDs)) / 2, zero from 1.5 LEDs away
+      dotWeights[p][t] = d >= 384 ? 0 : (uint16_t)((int32_t)cos16(d * 256 / 3) + 32768) >> 8;
+    }
+  }
+  for (byte i = 0; i < COMET_FALLOFF; i++) {
+    uint16_t rest = COMET_FALLOFF - 1 - i;
+    cometFalloff[i] = rest * rest * 255 / ((COMET_FALLOFF - 1) * (COMET_FALLOFF - 1));
+  }
+}
+
+void drawDot(CRGB* strip, int32_t pos, const CRGB& color) {
+  int32_t rounded = pos + 128;
+  int16_t nearest = rounded >> 8;
+  const uint8_t* w = dotWeights[(rounded & 0xFF) / (256 / SUBPIXEL_PHASES)];
+  SubPixel::plot(strip, nearest - 1, color, w[0]);
+  SubPixel::plot(strip, nearest, color, w[1]);
+  SubPixel::plot(strip, nearest + 1, color, w[2]);
+}
+
+// From from to to (8.8, either order), end LEDs by how much of them is covered
+void drawBar(CRGB* strip, int32_t from, int32_t to, const CRGB& color) {
+  if (from > to) { int32_t t = from; from = to; to = t; }
+  from = max(from, (int32_t)-128);
+  to = min(to, (int32_t)(NUM_LEDS * 256 - 129));
+  for (int32_t i = (from + 128) >> 8; i <= (to + 128) >> 8; i++) {
+    int32_t left = max(from, i * 256 - 128), right = min(to, i * 256 + 127);
+    SubPixel::plot(strip, i, color, min(right - left + 1, (int32_t)255));
+  }
+}
+
+// Head at head (8.8), tail of tail LEDs behind it, direction +1/-1 is where the comet is going
+void drawComet(CRGB* strip, int32_t head, int8_t direction, uint8_t tail, const CRGB& color) {
+  drawDot(strip, head, color);
+  uint32_t step = (COMET_FALLOFF << 16) / ((uint32_t)tail << 8);  // falloff entries per 1/256 LED, 16.16
+  int16_t nearest = (head + 128) >> 8;
+  for (uint8_t t = 1; t <= tail; t++) {
+    int16_t i = nearest - t * direction;
+    int32_t behind = (head - (int32_t)i * 256) * direction;
+    uint32_t k = behind * step >> 16;
+    if (behind <= 0 || k >= COMET_FALLOFF) continue;
+    SubPixel::plot(strip, i, color, cometFalloff[k]);
+  }
+}
+
+// GESTURES //
+
+// Called for every note-on after it has been drawn, leds[led] has the note colour
+void detectGesture(byte led) {
+  GestureState& g = gesture;
+  uint16_t now = millis();
+  const GestureNote& prev = g.history[(g.head + GESTURE_HISTORY - 1) % GESTURE_HISTORY];
+  const GestureNote& prev2 = g.history[(g.head + GESTURE_HISTORY - 2) % GESTURE_HISTORY];
+  uint16_t gap = now - prev.ms;
+  int step = g.count ? (int)led - prev.led : 0;
+  int prevStep = g.count > 1 ? (int)prev.led - prev2.led : 0;
+
+  if (g.count == 0 || gap > GESTURE_GAP_MS) {
+    g.glissRun = g.alternateRun = g.repeatRun = 0;
+  } else {
+    // Glissando: steps of 1-2 keys, all in the same direction, played fast
+    bool glissStep = gap <= GLISS_GAP_MS && step != 0 && abs(step) <= 2 && (g.glissRun == 0 || (step > 0) == (prevStep > 0));
+    g.glissRun = glissStep ? g.glissRun + 1 : 0;
+    // Trill/tremolo: back to the key before the previous one
+    bool alternate = g.count > 1 && step != 0 && led == prev2.led;
+    g.alternateRun = alternate ? g.alternateRun + 1 : (step != 0 ? 1 : 0);
+    g.repeatRun = step == 0 ? g.repeatRun + 1 : 0;
+  }
+
+  g.history[g.head].ms = now;
+  g.history[g.head].led = led;
+  g.head = (g.head + 1) % GESTURE_HISTORY;
+  if (g.count < GESTURE_HISTORY) g.count++;
+
+  if (g.glissRun >= GESTURE_MIN_RUN - 1) {
+    // Speed over the notes still in the history
+    byte back = min(g.glissRun, (uint8_t)(GESTURE_HISTORY - 1));
+    const GestureNote& first = g.history[(g.head + GESTURE_HISTORY - 1 - back) % GESTURE_HISTORY];
+    uint16_t span = (uint16_t)(now - first.ms);
+    g.type = GESTURE_GLISSANDO;
+    g.direction = step > 0 ? 1 : -1;
+    g.speed = (uint32_t)abs((int)led - first.led) * 1000 / (span ? span : 1);
+    g.cometPos = (int32_t)led << 8;
+    g.frameMs = millis();
+  } else if (g.alternateRun >= GESTURE_MIN_RUN - 1) {
+    g.type = abs(step) <= 2 ? GESTURE_TRILL : GESTURE_TREMOLO;
+    g.keyA = led;
+    g.keyB = prev.led;
+  } else if (g.repeatRun >= GESTURE_MIN_RUN - 2) {
+    g.type = GESTURE_REPEAT;
+    g.keyA = g.keyB = led;
+  } else {
+    return;
+  }
+  g.color = leds[led];
+  g.lastMs = millis();
+}
+
+// Draws the active gesture over the faded frame
+void renderGesture() {
+  GestureState& g = gesture;
+  if (g.type == GESTURE_NONE) return;
+  uint32_t now = millis();
+
+  if (g.type == GESTURE_GLISSANDO) {
+    if (now - g.lastMs > COMET_MS) {
+      g.type = GESTURE_NONE;
+      return;
+    }
+    g.cometPos += (int32_t)g.direction * g.speed * (int32_t)(now - g.frameMs) * 256 / 1000;
+    g.frameMs = now;
+    CRGB c = g.color;
+    c.nscale8(255 - (now - g.lastMs) * 255 / COMET_MS);
+    drawComet(leds, g.cometPos, g.direction, COMET_TAIL, c);
+    return;
+  }
+
+  // Trill, tremolo, repeated notes: steady shimmer while the figure goes on
+  if (now - g.lastMs > GESTURE_GAP_MS) {
+    g.type = GESTURE_NONE;
+    return;
+  }
+  uint8_t level = 190 + scale8(sin8(now / 3), 65);
+  CRGB c = g.color;
+  c.nscale8(level);
+  leds[g.keyA] = c;
+  c = g.color;
+  c.nscale8(255 - level + 190);
+  leds[g.keyB] = c;
+}
+
+// VOICE SWEEPS //
+
+void trackVoice(uint8_t pitch, uint8_t led) {
+  uint32_t now = millis();
+  voiceNotes++;
+  Voice* nearest = NULL;
+  Voice* free = NULL;
+  Voice* oldest = &voices[0];
+  uint8_t distance = 255;
+  for (byte v = 0; v < VOICES; v++) {
+    Voice& voice = voices[v];
+    if (voice.pitch && now - voice.lastMs > VOICE_TIMEOUT_MS) voice.pitch = 0;
+    if (!voice.pitch) {
+      if (!free) free = &voice;
+      continue;
+    }
+    if ((int32_t)(voice.lastMs - oldest->lastMs) < 0) oldest = &voice;
+    if (now - voice.lastMs < CHORD_MS) continue;  // already has a note of this chord
+    uint8_t d = abs(pitch - voice.pitch);
+    if (d < distance) {
+      distance = d;
+      nearest = &voice;
+    }
+  }
+
+  Voice* voice = nearest;
+  if (!nearest || (distance > VOICE_MAX_LEAP && free)) {
+    voice = free ? free : oldest;      // a new line starts, nothing to connect
+  } else if (nearest->led != led && !(GESTURES && gesture.type == GESTURE_GLISSANDO)) {
+    Sweep& sweep = sweeps[sweepHead];
+    sweepHead = (sweepHead + 1) % SWEEPS;
+    sweep.from = nearest->led;
+    sweep.to = led;
+    sweep.fromColor = nearest->color;
+    sweep.toColor = leds[led];
+    sweep.startMs = now;
+    sweep.active = true;
+    voiceSweeps++;
+  }
+  voice->pitch = pitch;
+  voice->led = led;
+  voice->color = leds[led];
+  voice->lastMs = now;
+}
+
+void renderSweeps() {
+  uint32_t now = millis();
+  for (byte i = 0; i < SWEEPS; i++) {
+    Sweep& sweep = sweeps[i];
+    if (!sweep.active) continue;
+    uint32_t elapsed = now - sweep.startMs;
+    if (elapsed >= SWEEP_MS) {
+      sweep.active = false;
+      continue;
+    }
+    uint8_t progress = ease8InOutQuad(elapsed * 255 / SWEEP_MS);
+    int32_t head = ((int32_t)sweep.from << 8) + ((int32_t)(sweep.to - sweep.from) * progress);
+    CRGB c = blend(sweep.fromColor, sweep.toColor, progress);
+    drawComet(leds, head, sweep.to > sweep.from ? 1 : -1, SWEEP_TAIL, c);
+  }
+}
+
+void printVoiceReport() {
+  debugA("Voice sweeps %s: %lu notes, %lu sweeps", sweepsOn ? "on" : "off", voiceNotes, voiceSweeps);
+  uint32_t now = millis();
+  for (byte v = 0; v < VOICES; v++) {
+    if (voices[v].pitch) debugA("  voice %u: note %u, %lu ms ago", v, voices[v].pitch, now - voices[v].lastMs);
+  }
+}
+
+// INTERVAL SPANS //
+
+void renderSpans() {
+  if (spanLow <= spanHigh) fill_solid(leds + spanLow, spanHigh - spanLow + 1, CRGB::Black);
+  spanLow = NUM_LEDS;
+  spanHigh = 0;
+  int16_t prev = -1;
+  for (byte w = 0; w < KEY_WORDS; w++) {
+    uint32_t bits = heldMask[w];
+    while (bits) {
+      byte led = w * 32 + __builtin_ctz(bits);
+      bits &= bits - 1;
+      if (prev < 0) {
+        spanLow = led;
+      } else {
+        CRGB color(pgm_read_dword(&intervalColors[(led - prev) % 12]));
+        color.nscale8(SPAN_LEVEL);
+        fill_solid(leds + prev + 1, led - prev - 1, color);
+      }
+      leds[led] = CRGB(SPAN_KEY_LEVEL, SPAN_KEY_LEVEL, SPAN_KEY_LEVEL);
+      prev = led;
+    }
+  }
+  if (prev >= 0) spanHigh = prev;
+}
+
+// NEXT NOTE PREDICTION //
+
+uint16_t ngramSlot(uint8_t older, uint8_t newer) {
+  uint16_t key = (older & 0x7F) << 7 | (newer & 0x7F);
+  return (uint16_t)(key * 40503u) >> 7 & (NGRAM_SLOTS - 1);  // Fibonacci hashing
+}
+
+// Learns that pitch followed the last two notes, then predicts and pre-warms what follows pitch.
+// Called for every note-on after it has been drawn, leds[led] has the note colour.
+void predictNext(uint8_t pitch, byte led) {
+  // Score the previous prediction
+  predictNotes++;
+  if (predicted[0] == pitch) predictTop1++;
+  if (predicted[0] == pitch || predicted[1] == pitch) predictTop2++;
+
+  // Learn
+  NgramSlot& learn = ngram[ngramSlot(ngramPrev[0], ngramPrev[1])];
+  if (learn.next[0] == pitch) {
+    learn.count[0]++;
+  } else if (learn.next[1] == pitch) {
+    learn.count[1]++;
+    if (learn.count[1] > learn.count[0]) {
+      uint8_t n = learn.next[0], c = learn.count[0];
+      learn.next[0] = learn.next[1]; learn.count[0] = learn.count[1];
+      learn.next[1] = n; learn.count[1] = c;
+    }
+  } else if (learn.count[1] == 0) {
+    learn.next[1] = pitch;
+    learn.count[1] = 1;
+  } else {
+    learn.count[1]--;
+  }
+  if (learn.count[0] == 255) {
+    learn.count[0] >>= 1;
+    learn.count[1] >>= 1;
+  }
+  ngramPrev[0] = ngramPrev[1];
+  ngramPrev[1] = pitch;
+
+  // Predict
+  const NgramSlot& next = ngram[ngramSlot(ngramPrev[0], ngramPrev[1])];
+  for (byte i = 0; i < 2; i++) {
+    predicted[i] = next.count[i] ? next.next[i] : 0;
+    if (!predictOn || mode < 2 || next.count[i] < PREWARM_MIN_COUNT || predicted[i] == pitch) continue;
+    byte warm = noteLed(predicted[i]);
+    if (onLeds[warm]) continue;
+    CRGB c = (mode == 4) ? keyPalette[warm] : leds[led];
+    c.nscale8(PREWARM_LEVEL);
+    leds[warm] |= c;
+  }
+}
+
+void printPredictionReport() {
+  uint16_t used = 0;
+  for (uint16_t i = 0; i < NGRAM_SLOTS; i++) used += ngram[i].count[0] > 0;
+  debugA("Prediction %s: %lu notes, top-1 %lu%%, top-2 %lu%%", predictOn ? "on" : "off", predictNotes,
+         predictNotes ? predictTop1 * 100 / predictNotes : 0, predictNotes ? predictTop2 * 100 / predictNotes : 0);
+  debugA("Model: %u of %u contexts used, %u bytes", used, NGRAM_SLOTS, sizeof(ngram));
+}
+
+// SCORE FOLLOWING //
+
+uint16_t scoreLength() {
+  return songLoaded ? song.eventCount : sizeof(builtinSong);
+}
+
+uint8_t scoreNote(uint16_t i) {
+  if (i >= scoreLength()) return 0;
+  if (!songLoaded) return pgm_read_byte(&builtinSong[i]);
+  SongEvent e;
+  return readSongEvent(i, e) ? e.pitch : 0;
+}
+
+// Expect the score note at pos next
+void followAt(uint16_t pos) {
+  follow.pos = pos;
+  follow.winStart = pos > FOLLOW_BACK ? pos - FOLLOW_BACK : 0;
+  memset(follow.cost, COST_INF, sizeof(follow.cost));
+  follow.cost[pos - follow.winStart] = 0;
+  follow.misses = 0;
+  follow.scanning = false;
+}
+
+void followNote(uint8_t pitch) {
+  FollowState& f = follow;
+  uint16_t length = scoreLength();
+  memmove(f.recent, f.recent + 1, FOLLOW_CONTEXT - 1);
+  f.recent[FOLLOW_CONTEXT - 1] = pitch;
+
+  // One DTW step over the window
+  uint8_t next[FOLLOW_WINDOW];
+  uint8_t best = COST_INF;
+  byte bestK = 0;
+  for (byte k = 0; k < FOLLOW_WINDOW; k++) {
+    uint16_t at = f.winStart + k;
+    uint16_t c = f.cost[k] + COST_EXTRA;                        // extra note, stay
+    if (k >= 1 && at >= 1) {
+      uint8_t mismatch = scoreNote(at - 1) == pitch ? 0 : COST_MISMATCH;
+      c = min(c, (uint16_t)(f.cost[k - 1] + mismatch));         // played note at-1
+      if (k >= 2) c = min(c, (uint16_t)(f.cost[k - 2] + COST_SKIP + mismatch));  // skipped at-2
+    }
+    next[k] = at > length ? COST_INF : min(c, (uint16_t)COST_INF);
+    if (next[k] < best) {
+      best = next[k];
+      bestK = k;
+    }
+  }
+  uint16_t pos = f.winStart + bestK;
+  bool matched = pos >= 1 && pos != f.pos && scoreNote(pos - 1) == pitch;
+  f.misses = (f.misses << 1 | !matched) & 0xF;
+
+  // Recenter the window on the best position, costs relative to the best
+  uint16_t start = pos > FOLLOW_BACK ? pos - FOLLOW_BACK : 0;
+  for (byte k = 0; k < FOLLOW_WINDOW; k++) {
+    uint16_t from = start + k - f.winStart;
+    f.cost[k] = (start + k >= f.winStart && from < FOLLOW_WINDOW && next[from] != COST_INF) ? next[from] - best : COST_INF;
+  }
+  f.winStart = start;
+  f.pos = pos;
+  if (pos >= length) followAt(0);  // the end, expect it to start over
+  else if (loopEndEvent && pos >= loopEndEvent) followAt(loopStartEvent);
+
+  // Lost: look for the last few notes elsewhere, a slice of the song per note
+  if (__builtin_popcount(f.misses) >= FOLLOW_LOST) {
+    if (!f.scanning) f.scanPos = f.pos;
+    f.scanning = true;
+    for (byte n = 0; n < FOLLOW_SCAN && n < length; n++) {
+      uint16_t at = f.scanPos;  // last note of the context
+      f.scanPos = (f.scanPos + 1) % length;
+      if (at < FOLLOW_CONTEXT - 1) continue;
+      byte i = 0;
+      while (i < FOLLOW_CONTEXT && scoreNote(at + 1 - FOLLOW_CONTEXT + i) == f.recent[i]) i++;
+      if (i == FOLLOW_CONTEXT) {
+        followAt(at + 1 < length ? at + 1 : 0);
+        break;
+      }
+    }
+  }
+}
+
+// Lights the next notes of the score, dimmer further ahead
+void renderFollow() {
+  uint8_t level = FOLLOW_LEVEL;
+  for (byte i = 0; i < FOLLOW_AHEAD; i++, level >>= 1) {
+    uint8_t pitch = scoreNote(follow.pos + i);
+    if (!pitch) break;
+    byte led = noteLed(pitch);
+    if (!onLeds[led]) leds[led] |= CRGB(level, level, level);
+  }
+}
+
+// Simulated performances of the stored song: clean, 1 in 10 notes wrong, a skipped bar and a
+// repeated bar. A note is tracked when the follower expects the score note after the one the
+// player meant to play.
+void runFollowTest() {
+  FollowState saved = follow;
+  uint16_t savedLoopEnd = loopEndEvent;
+  loopEndEvent = 0;
+  uint16_t length = scoreLength();
+  const char* names[] = {"clean", "wrong notes", "skipped bar", "repeated bar"};
+  for (byte kind = 0; kind < 4; kind++) {
+    followAt(0);
+    uint16_t played = 0, tracked = 0;
+    uint32_t cycles = 0, worst = 0;
+    for (uint16_t i = 0; i < length; i++) {
+      uint16_t meant = i;
+      if (kind == 2 && i >= length / 2) meant = i + 8;       // jumps a bar ahead halfway
+      if (kind == 3 && i >= length / 2) meant = i - 8;       // goes back a bar halfway
+      if (meant >= length) break;
+      uint8_t pitch = scoreNote(meant);
+      if (kind == 1 && i % 10 == 7) pitch += 1;
+      uint32_t start = ESP.getCycleCount();
+      followNote(pitch);
+      uint32_t spent = ESP.getCycleCount() - start;
+      cycles += spent;
+      if (spent > worst) worst = spent;
+      played++;
+      tracked += follow.pos == (meant + 1) % length;
+    }
+    debugA("%-13s %3u%% tracked, %lu cycles/note average, %lu max", names[kind], played ? tracked * 100 / played : 0,
+           played ? cycles / played : 0, worst);
+    yield();
+  }
+  debugA("Song: %u notes, %u bytes of follower state", length, sizeof(FollowState));
+  follow = saved;
+  loopEndEvent = savedLoopEnd;
+}
+
+// SONG FILES //
+
+bool loadSong() {
+  if (songFile) songFile.close();
+  songLoaded = false;
+  loopEndEvent = 0;
+  for (byte i = 0; i < SONG_CACHE_BLOCKS; i++) songCache[i].block = SONG_NO_BLOCK;
+  songFile = LittleFS.open(SONG_FILE, "r");
+  if (!songFile) return false;
+  uint32_t size = songFile.size();
+  if (songFile.read((uint8_t*)&song, sizeof(song)) != sizeof(song) || song.magic != SONG_MAGIC) {
+    debugE("Song: %s is not a compiled song, see tools/song_compile.py", SONG_FILE);
+    songFile.close();
+    return false;
+  }
+  // songBarEvent divides by barsPerIndex and reads the last index entry, following needs a note
+  uint32_t expected = sizeof(SongHeader) + ((uint32_t)song.indexCount + song.eventCount) * 8;
+  if (song.barsPerIndex == 0 || song.indexCount == 0 || song.eventCount == 0 || expected != size) {
+    debugE("Song: %s is damaged (%u notes, %u index entries of %u bars, %lu bytes, %lu expected)",
+           SONG_FILE, song.eventCount, song.indexCount, song.barsPerIndex, size, expected);
+    songFile.close();
+    return false;
+  }
+  songLoaded = true;
+  debugI("Song: %u notes, %u bars, %lu s", song.eventCount, song.indexCount * song.barsPerIndex, song.durationMs / 1000);
+  return true;
+}
+
+// Bytes at offset of the song file, from the cache or one block read. Records are 8 bytes and
+// 8-byte aligned, so they never straddle a block.
+const uint8_t* songBytes(uint32_t offset) {
+  uint16_t block = offset / SONG_BLOCK;
+  byte slot = songCacheLast;
+  if (songCache[slot].block != block) {
+    slot = SONG_CACHE_BLOCKS;
+    for (byte i = 0; i < SONG_CACHE_BLOCKS; i++) {
+      if (songCache[i].block == block) slot = i;
+    }
+    if (slot == SONG_CACHE_BLOCKS) {
+      slot = (songCacheLast + 1) % SONG_CACHE_BLOCKS;  // least recently used of two
+      songCacheMisses++;
+      songCache[slot].block = SONG_NO_BLOCK;
+      if (!songFile.seek((uint32_t)block * SONG_BLOCK)) return NULL;
+      TRACE_BEGIN(TRACE_FILE, block);
+      songFile.read(songCache[slot].data, SONG_BLOCK);
+      TRACE_END(TRACE_FILE);
+      songCache[slot].block = block;
+    } else {
+      songCacheHits++;
+    }
+  } else {
+    songCacheHits++;
+  }
+  songCacheLast = slot;
+  return songCache[slot].data + offset % SONG_BLOCK;
+}
+
+bool readSongIndex(uint16_t i, SongIndexEntry& entry) {
+  if (!songLoaded || i >= song.indexCount) return false;
+  const uint8_t* p = songBytes(sizeof(SongHeader) + (uint32_t)i * sizeof(SongIndexEntry));
+  if (!p) return false;
+  memcpy(&entry, p, sizeof(entry));
+  return true;
+}
+
+bool readSongEvent(uint16_t i, SongEvent& e) {
+  if (!songLoaded || i >= song.eventCount) return false;
+  const uint8_t* p = songBytes(sizeof(SongHeader) + (uint32_t)song.indexCount * sizeof(SongIndexEntry) + (uint32_t)i * sizeof(SongEvent));
+  if (!p) return false;
+  memcpy(&e, p, sizeof(e));
+  return true;
+}
+
+// First event of the indexed bar at or before bar, the song length if it's past the end
+uint16_t songBarEvent(uint16_t bar) {
+  SongIndexEntry entry;
+  if (!readSongIndex(min(bar / song.barsPerIndex, song.indexCount - 1), entry)) return 0;
+  return entry.ms > song.durationMs ? song.eventCount : entry.event;
+}
+
+void seekSongBar(uint16_t bar) {
+  if (!songLoaded) {
+    debugW("Song: no %s, the built-in melody has no bars", SONG_FILE);
+    return;
+  }
+  uint16_t event = songBarEvent(bar);
+  followAt(min(event, (uint16_t)(song.eventCount - 1)));
+  debugA("Song: bar %u, note %u", bar, follow.pos);
+}
+
+void setSongLoop(uint16_t fromBar, uint16_t toBar) {
+  if (!songLoaded || toBar <= fromBar) {
+    loopEndEvent = 0;
+    debugA("Loop off");
+    return;
+  }
+  loopStartEvent = songBarEvent(fromBar);
+  loopEndEvent = songBarEvent(toBar);
+  followAt(loopStartEvent);
+  debugA("Loop: bars %u-%u, notes %u-%u", fromBar, toBar - 1, loopStartEvent, loopEndEvent - 1);
+}
+
+void printSongReport() {
+  if (!songLoaded) {
+    debugA("Song: built-in melody, %u notes (no %s)", sizeof(builtinSong), SONG_FILE);
+    return;
+  }
+  debugA("Song: %u notes, %u index entries every %u bars, %lu ms", song.eventCount, song.indexCount, song.barsPerIndex, song.durationMs);
+  debugA("Cache: %u x %u bytes, %lu hits, %lu misses", SONG_CACHE_BLOCKS, SONG_BLOCK, songCacheHits, songCacheMisses);
+  if (loopEndEvent) debugA("Loop: notes %u-%u", loopStartEvent, loopEndEvent - 1);
+}
+
+// NOISE FIELD //
+
+void startNoise(uint8_t look, uint32_t now) {
+  const NoiseLook& l = noiseLooks[look];
+  noiseLookId = look;
+  switch (look) {
+    case NOISE_LAVA: noisePalette = LavaColors_p; break;
+    case NOISE_WATER: noisePalette = OceanColors_p; break;
+    default: noisePalette = GP_Aurora; break;
+  }
+  noiseFrom = 0;
+  noiseTo = 1;
+  noiseNext = 2;
+  noiseNextBuilt = 0;
+  noiseFromMs = now;
+  noiseFromY = random16() << 8;
+  uint32_t step = (uint32_t)l.speed * NOISE_PERIOD_MS / 1000;
+  for (byte i = 0; i < NUM_LEDS; i++) {
+    noiseSnapshots[noiseFrom][i] = Noise::octaves(0, NOISE_OCTAVES - 1, i, l.scale, noiseFromY);
+    noiseSnapshots[noiseTo][i] = Noise::octaves(0, NOISE_OCTAVES - 1, i, l.scale, noiseFromY + step);
+  }
+}
+
+// Brings noiseValue[] to the time now
+void stepNoise(uint8_t look, uint32_t now) {
+  // After a long gap (another mode, no frames) start a fresh field instead of catching up
+  if (look != noiseLookId || now - noiseFromMs > 2 * NOISE_PERIOD_MS) startNoise(look, now);
+  const NoiseLook& l = noiseLooks[look];
+  uint32_t step = (uint32_t)l.speed * NOISE_PERIOD_MS / 1000;
+  uint32_t elapsed = now - noiseFromMs;
+  while (elapsed >= NOISE_PERIOD_MS) {
+    while (noiseNextBuilt < NUM_LEDS) {
+      noiseSnapshots[noiseNext][noiseNextBuilt] = Noise::octaves(0, NOISE_OCTAVES - 1, noiseNextBuilt, l.scale, noiseFromY + 2 * step);
+      noiseNextBuilt++;
+    }
+    uint8_t old = noiseFrom;
+    noiseFrom = noiseTo;
+    noiseTo = noiseNext;
+    noiseNext = old;
+    noiseNextBuilt = 0;
+    noiseFromMs += NOISE_PERIOD_MS;
+    noiseFromY += step;
+    elapsed -= NOISE_PERIOD_MS;
+  }
+
+  // The share of the next snapshot due by now
+  byte due = elapsed * NUM_LEDS / NOISE_PERIOD_MS;
+  while (noiseNextBuilt < due) {
+    noiseSnapshots[noiseNext][noiseNextBuilt] = Noise::octaves(0, NOISE_OCTAVES - 1, noiseNextBuilt, l.scale, noiseFromY + 2 * step);
+    noiseNextBuilt++;
+  }
+
+  uint8_t t = elapsed * 256 / NOISE_PERIOD_MS;
+  uint32_t y = noiseFromY + (step * t >> 8);
+  const int16_t* from = noiseSnapshots[noiseFrom];
+  const int16_t* to = noiseSnapshots[noiseTo];
+  for (byte i = 0; i < NUM_LEDS; i++) {
+    int16_t v = from[i] + ((int32_t)(to[i] - from[i]) * t >> 8);
+    v += Noise::octaves(NOISE_OCTAVES - 1, NOISE_OCTAVES, i, l.scale, y);
+    noiseValue[i] = constrain(128 + v - (v >> 2), 0, 255);
+  }
+}
+
+void fillNoise(uint8_t look) {
+  stepNoise(look, millis());
+  for (byte i = 0; i < NUM_LEDS; i++) leds[i] = ColorFromPalette(noisePalette, noiseValue[i]);
+}
+
+// Under the notes: only keys that aren't held, and never brighter than what fades there
+void renderBackground() {
+  stepNoise(backgroundLook, millis());
+  uint8_t level = scale8(BACKGROUND_LEVEL, pgm_read_byte(&contrastCap[ContrastStage::step]));
+  for (byte i = 0; i < NUM_LEDS; i++) {
+    if (!onLeds[i]) leds[i] |= ColorFromPalette(noisePalette, noiseValue[i], level);
+  }
+}
+
+void setBackground(const String& name) {
+  backgroundLook = NOISE_OFF;
+  for (byte look = 0; look < NOISE_LOOKS; look++) {
+    if (!strcmp_P(name.c_str(), noiseLookNames[look])) backgroundLook = look;
+  }
+  if (backgroundLook == NOISE_OFF) debugA("Background off");
+  else debugA("Background: %s", name.c_str());
+}
+
+// TRACING //
+
+// Chrome trace-event JSON, timestamps in us from the oldest entry. Recording is paused meanwhile.
+// Ends whose begin was overwritten are skipped; entries more than ~50 s apart would wrap.
+void printTrace() {
+#if TRACING
+  bool wasFrozen = traceFrozen;
+  traceFrozen = true;
+  uint16_t first = traceHead - traceFilled;
+  uint32_t mhz = ESP.getCpuFreqMHz();
+  uint32_t prev = traceRing[first & (TRACE_SIZE - 1)].cycles;
+  uint32_t us = 0, rest = 0;
+  uint8_t depth = 0;
+  bool comma = false;
+  char name[8];
+  rdebugA("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (uint16_t i = first; i != traceHead; i++) {
+    const TraceEntry& t = traceRing[i & (TRACE_SIZE - 1)];
+    rest += t.cycles - prev;
+    prev = t.cycles;
+    us += rest / mhz;
+    rest %= mhz;
+    bool end = t.span & TRACE_END_BIT;
+    if (end) {
+      if (depth == 0) continue;
+      depth--;
+    } else {
+      depth++;
+    }
+    strcpy_P(name, traceNames[t.span & ~TRACE_END_BIT]);
+    rdebugA("%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lu.%03lu,\"pid\":1,\"tid\":1,\"args\":{\"arg\":%u}}\n",
+            comma ? "," : "", name, end ? 'E' : 'B', us, rest * 1000 / mhz, t.arg);
+    comma = true;
+    if ((i & 31) == 0) yield();
+  }
+  rdebugA("]}\n");
+  traceFrozen = wasFrozen;
+#else
+  debugA("Build with TRACING true to record spans");
+#endif
+}
+
+void clearTrace() {
+#if TRACING
+  traceHead = 0;
+  traceFilled = 0;
+  traceFrozen = false;
+#endif
+}
+
+// CUES //
+
+// Reads /cues.txt: "cue <note> [loop]" starts a cue, then one "<ms> <first led> <last led> <r> <g> <b>"
+// line per keyframe, in time order. # starts a comment.
+bool loadCues() {
+  memset(cueByNote, CUE_NONE, sizeof(cueByNote));
+  cueCount = 0;
+  cueKeyframeCount = 0;
+  for (byte v = 0; v < CUE_VOICES; v++) cueVoices[v].cue = CUE_NONE;
+  File f = LittleFS.open(CUES_FILE, "r");
+  if (!f) return false;
+  char line[64];
+  byte len = 0;
+  uint16_t lineNo = 0;
+  for (;;) {
+    int c = f.read();
+    if (c != '\n' && c >= 0) {
+      if (c != '\r' && len < sizeof(line) - 1) line[len++] = c;
+      continue;
+    }
+    line[len] = 0;
+    len = 0;
+    lineNo++;
+    parseCueLine(line, lineNo);
+    if (c < 0) break;
+  }
+  f.close();
+  debugI("Cues: %u cues, %u keyframes", cueCount, cueKeyframeCount);
+  return true;
+}
+
+void parseCueLine(char* line, uint16_t lineNo) {
+  char* hash = strchr(line, '#');
+  if (hash) *hash = 0;
+  char* p = line;
+  while (*p == ' ' || *p == '\t') p++;
+  if (!*p) return;
+
+  if (!strncmp_P(p, PSTR("cue "), 4)) {
+    long note = strtol(p + 4, &p, 10);
+    if (note < 0 || note > 127 || cueCount >= CUE_COUNT) {
+      debugW("Cues: line %u, bad note or more than %u cues", lineNo, CUE_COUNT);
+      return;
+    }
+    Cue& cue = cues[cueCount];
+    cue.keyframe = cueKeyframeCount;
+    cue.count = 0;
+    cue.loop = strstr_P(p, PSTR("loop")) != NULL;
+    cueByNote[note] = cueCount++;
+    return;
+  }
+
+  long v[6];
+  for (byte i = 0; i < 6; i++) v[i] = strtol(p, &p, 10);
+  if (cueCount == 0 || cueKeyframeCount >= CUE_KEYFRAMES) {
+    debugW("Cues: line %u, keyframe outside a cue or pool full", lineNo);
+    return;
+  }
+  Cue& cue = cues[cueCount - 1];
+  uint16_t ms = constrain(v[0], 0, 65535);
+  // keyframes have to move forward in time, renderCues divides by the gap
+  if (cue.count > 0 && ms <= cueKeyframes[cueKeyframeCount - 1].ms) {
+    debugW("Cues: line %u, keyframe at %u ms is not after the one before", lineNo, ms);
+    return;
+  }
+  CueKeyframe& k = cueKeyframes[cueKeyframeCount++];
+  k.ms = ms;
+  k.first = constrain(min(v[1], v[2]), 0, NUM_LEDS - 1);
+  k.last = constrain(max(v[1], v[2]), 0, NUM_LEDS - 1);
+  k.color = CRGB(constrain(v[3], 0, 255), constrain(v[4], 0, 255), constrain(v[5], 0, 255));
+  cue.count++;
+}
+
+void handleCueEvent(const MidiEvent& e) {
+  if (e.status() == UMP_CONTROL_CHANGE && e.index() == 123) {
+    for (byte v = 0; v < CUE_VOICES; v++) cueVoices[v].cue = CUE_NONE;
+    return;
+  }
+  if (e.status() != UMP_NOTE_ON) return;
+  uint8_t cue = cueByNote[e.index() & 0x7F];
+  if (cue == CUE_NONE || cues[cue].count == 0) return;
+  recordFlight(FLIGHT_CUE, e.index(), cue);
+
+  // Restart the same cue, else a free voice, else the oldest
+  CueVoice* voice = &cueVoices[0];
+  for (byte v = 0; v < CUE_VOICES; v++) {
+    CueVoice& c = cueVoices[v];
+    if (c.cue == cue) { voice = &c; break; }
+    if (c.cue == CUE_NONE && voice->cue != CUE_NONE) voice = &c;
+    else if (voice->cue != CUE_NONE && c.cue != CUE_NONE && (int32_t)(c.startMs - voice->startMs) < 0) voice = &c;
+  }
+  voice->cue = cue;
+  voice->segment = 0;
+  voice->shown = false;
+  voice->startMs = millis();
+  voice->triggerUs = micros();
+  frameDue = true;
+}
+
+// Lays the running cues over the frame. The frame under them is kept in
+// cueUnder and put back by cuesShown, so fading keyframes don't pile up.
+void renderCues() {
+  uint32_t now = millis();
+  for (byte v = 0; v < CUE_VOICES; v++) {
+    CueVoice& voice = cueVoices[v];
+    if (voice.cue == CUE_NONE) continue;
+    const Cue& cue = cues[voice.cue];
+    const CueKeyframe* k = &cueKeyframes[cue.keyframe];
+    uint32_t t = now - voice.startMs;
+    uint16_t end = k[cue.count - 1].ms;
+    if (t > end) {
+      if (!cue.loop || end == 0) {
+        voice.cue = CUE_NONE;
+        continue;
+      }
+      t %= end;
+      voice.startMs = now - t;
+      voice.segment = 0;
+    }
+    while (voice.segment + 1 < cue.count && t >= k[voice.segment + 1].ms) voice.segment++;
+
+    const CueKeyframe& a = k[voice.segment];
+    byte first = a.first, last = a.last;
+    CRGB color = a.color;
+    if (voice.segment + 1 < cue.count && k[voice.segment + 1].ms > a.ms) {
+      const CueKeyframe& b = k[voice.segment + 1];
+      fract8 f = (t - a.ms) * 255 / (b.ms - a.ms);
+      first = lerp8by8(a.first, b.first, f);
+      last = lerp8by8(a.last, b.last, f);
+      color = blend(a.color, b.color, f);
+    }
+    if (!cueDrawn) {
+      memcpy(cueUnder, leds, sizeof(cueUnder));
+      cueDrawn = true;
+    }
+    for (byte i = first; i <= last; i++) leds[i] |= color;
+  }
+}
+
+bool cuesRunning() {
+  for (byte v = 0; v < CUE_VOICES; v++) if (cueVoices[v].cue != CUE_NONE) return true;
+  return false;
+}
+
+// Called right after show: puts the frame under the cues back
+void cuesShown() {
+  cueLit = cueDrawn;
+  if (cueDrawn) {
+    memcpy(leds, cueUnder, sizeof(cueUnder));
+    cueDrawn = false;
+  }
+  for (byte v = 0; v < CUE_VOICES; v++) {
+    CueVoice& voice = cueVoices[v];
+    if (voice.cue == CUE_NONE || voice.shown) continue;
+    voice.shown = true;
+    uint32_t latency = micros() - voice.triggerUs;
+    cueTriggers++;
+    cueLatencyTotal += latency;
+    if (latency > cueLatencyMax) cueLatencyMax = latency;
+  }
+}
+
+void printCueReport() {
+  debugA("Cues on channel %u: %u of %u cues, %u of %u keyframes", config->cueChannel, cueCount, CUE_COUNT, cueKeyframeCount, CUE_KEYFRAMES);
+  for (byte note = 0; note < 128; note++) {
+    uint8_t c = cueByNote[note];
+    if (c != CUE_NONE) debugA("  note %3u: %u keyframes, %u ms%s", note, cues[c].count, cueKeyframes[cues[c].keyframe + cues[c].count - 1].ms, cues[c].loop ? ", loop" : "");
+  }
+  if (cueTriggers) debugA("Trigger to show: %lu us average, %lu us max over %lu triggers", cueLatencyTotal / cueTriggers, cueLatencyMax, cueTriggers);
+}
+
+// Fires every cue through the network MIDI callback and runs the loop's event and show stages
+// until it is on the strip, then stops it
+void runCueTest() {
+  cueTriggers = cueLatencyTotal = cueLatencyMax = 0;
+  WifiPeer* savedPeer = currentPeer;
+  currentPeer = &wifiPeers[WIFI_PEERS];
+  for (byte note = 0; note < 128; note++) {
+    if (cueByNote[note] == CUE_NONE) continue;
+    uint32_t triggers = cueTriggers;
+    uint32_t start = millis();
+    OnNoteOnWIFI(config->cueChannel, note, 127);
+    while (cueTriggers == triggers && millis() - start < 500) {
+      processEvents();
+      if (mode == 1) showPassive(); else showLeds();
+      yield();
+    }
+    OnControlChangeWIFI(config->cueChannel, 123, 0);
+    processEvents();
+  }
+  currentPeer = savedPeer;
+  printCueReport();
+}
+
+// SWAR KERNELS //
+
+// scale8 is (v * (1 + scale)) >> 8 with FASTLED_SCALE8_FIXED, (v * scale) >> 8 without
+uint16_t scaleFactor(uint8_t scale) {
+#if FASTLED_SCALE8_FIXED == 1
+  return scale + 1;
+#else
+  return scale;
+#endif
+}
+
+void scalarFade(CRGB* px, uint16_t n, uint8_t fadeBy) {
+  fadeToBlackBy(px, n, fadeBy);
+}
+
+void HOT_PATH swarFade(CRGB* px, uint16_t n, uint8_t fadeBy) {
+  uint32_t f = scaleFactor(255 - fadeBy);
+  uint8_t* p = (uint8_t*)px;
+  uint32_t len = n * 3;
+  for (; len && ((uintptr_t)p & 3); len--, p++) *p = (*p * f) >> 8;
+  uint32_t* w = (uint32_t*)p;
+  for (; len >= 4; len -= 4, w++) {
+    uint32_t v = *w;
+    *w = ((((v & SWAR_LANES) * f) >> 8) & SWAR_LANES) | ((((v >> 8) & SWAR_LANES) * f) & ~SWAR_LANES);
+  }
+  for (p = (uint8_t*)w; len; len--, p++) *p = (*p * f) >> 8;
+}
+
+void scalarBlend(CRGB* dst, const CRGB* src, uint16_t n, fract8 amountOfSrc) {
+  for (uint16_t i = 0; i < n; i++) nblend(dst[i], src[i], amountOfSrc);
+}
+
+// blend8 is (a * 256 + b + (b - a) * amount) >> 8 = (a * (256 - amount) + b * (1 + amount)) >> 8,
+// at most 65535 so the lanes never carry into each other
+void HOT_PATH swarBlend(CRGB* dst, const CRGB* src, uint16_t n, fract8 amountOfSrc) {
+#if FASTLED_BLEND_FIXED == 1
+  if (amountOfSrc == 0) return;
+  uint8_t* d = (uint8_t*)dst;
+  const uint8_t* s = (const uint8_t*)src;
+  if (((uintptr_t)d ^ (uintptr_t)s) & 3) {
+    scalarBlend(dst, src, n, amountOfSrc);  // can't align both
+    return;
+  }
+  uint32_t fa = 256 - amountOfSrc, fb = 1 + amountOfSrc;
+  uint32_t len = n * 3;
+  for (; len && ((uintptr_t)d & 3); len--, d++, s++) *d = (*d * fa + *s * fb) >> 8;
+  uint32_t* wd = (uint32_t*)d;
+  const uint32_t* ws = (const uint32_t*)s;
+  for (; len >= 4; len -= 4, wd++, ws++) {
+    uint32_t a = *wd, b = *ws;
+    uint32_t even = (a & SWAR_LANES) * fa + (b & SWAR_LANES) * fb;
+    uint32_t odd = ((a >> 8) & SWAR_LANES) * fa + ((b >> 8) & SWAR_LANES) * fb;
+    *wd = ((even >> 8) & SWAR_LANES) | (odd & ~SWAR_LANES);
+  }
+  d = (uint8_t*)wd;
+  s = (const uint8_t*)ws;
+  for (; len; len--, d++, s++) *d = (*d * fa + *s * fb) >> 8;
+#else
+  scalarBlend(dst, src, n, amountOfSrc);
+#endif
+}
+
+void selectKernels(bool swar) {
+  swarKernels = swar;
+  fadeKernel = swar ? swarFade : scalarFade;
+  blendKernel = swar ? swarBlend : scalarBlend;
+}
+
+// Runs both versions over random pixels at every offset and amount, true if all bytes match
+bool checkKernels() {
+  CRGB* a = (CRGB*)malloc(3 * KERNEL_CHECK_PIXELS * sizeof(CRGB));
+  if (!a) {
+    debugE("kernels: not enough heap");
+    return false;
+  }
+  CRGB* b = a + KERNEL_CHECK_PIXELS;
+  CRGB* src = b + KERNEL_CHECK_PIXELS;
+  uint32_t mismatches = 0;
+  for (uint16_t amount = 0; amount < 256; amount++) {
+    for (byte offset = 0; offset < 4; offset++) {
+      uint16_t n = KERNEL_CHECK_PIXELS - offset;
+      for (uint16_t i = 0; i < KERNEL_CHECK_PIXELS * 3; i++) ((uint8_t*)a)[i] = random8();
+      for (uint16_t i = 0; i < KERNEL_CHECK_PIXELS * 3; i++) ((uint8_t*)src)[i] = random8();
+      memcpy(b, a, KERNEL_CHECK_PIXELS * sizeof(CRGB));
+      scalarFade(a + offset, n, amount);
+      swarFade(b + offset, n, amount);
+      mismatches += memcmp(a, b, KERNEL_CHECK_PIXELS * sizeof(CRGB)) != 0;
+      scalarBlend(a + offset, src + offset, n, amount);
+      swarBlend(b + offset, src + offset, n, amount);
+      mismatches += memcmp(a, b, KERNEL_CHECK_PIXELS * sizeof(CRGB)) != 0;
+    }
+    yield();
+  }
+  free(a);
+  debugA("kernels: %s, %u of %u runs differ", mismatches ? "MISMATCH" : "bit-identical", mismatches, 256 * 4 * 2);
+  return mismatches == 0;
+}
+
+// Every field of an event comes back out as it went in
+bool checkEvents() {
+  uint32_t mismatches = 0, runs = 0;
+  for (uint16_t stamp = 0; stamp < 0x1000; stamp += 7) {
+    for (byte channel = 1; channel <= 16; channel++, runs++) {
+      uint8_t source = stamp % 2, status = 0x8 + channel % 8, index = stamp * 31 + channel;
+      bool replayed = stamp / 2 % 2;
+      uint32_t data = stamp * 0x9E3779B1UL;
+      MidiEvent e = MidiEvent::make(source | (replayed ? SRC_REPLAY : 0), status, channel, index, data, stamp);
+      mismatches += e.source() != source || e.replayed() != replayed || e.status() != status || e.channel() != channel
+                    || e.index() != index || e.stamp() != stamp || e.value() != data;
+    }
+  }
+  debugA("events: %s, %lu of %lu round trips differ", mismatches ? "MISMATCH" : "ok", mismatches, runs);
+  return mismatches == 0;
+}
+
+// BENCHMARKS //
+// "bench" over telnet times the FastLED primitives the sketch uses at 88 and 1000 pixels,
+// next to the table-driven or fixed-point alternatives we could replace them with (indented rows).
+// Results are CPU cycles per call (minimum of BENCH_REPS runs) and ns per pixel at 1000 pixels.
+// It blocks the loop for a few hundred ms.
+#define BENCH_REPS 8
+#define BENCH_BIG 1000
+
+volatile uint32_t benchSink;   // keeps scalar results alive
+
+uint32_t benchCycles(void (*fn)(CRGB*, uint16_t), CRGB* buf, uint16_t n) {
+  uint32_t best = UINT32_MAX;
+  for (byte r = 0; r < BENCH_REPS; r++) {
+    uint32_t start = ESP.getCycleCount();
+    fn(buf, n);
+    uint32_t spent = ESP.getCycleCount() - start;
+    if (spent < best) best = spent;
+  }
+  yield();
+  return best;
+}
+
+void benchPrimitive(PGM_P name, void (*fn)(CRGB*, uint16_t), CRGB* buf) {
+  char label[24];
+  strncpy_P(label, name, sizeof(label));
+  label[sizeof(label)-1] = 0;
+  uint32_t small = benchCycles(fn, buf, NUM_LEDS);
+  uint32_t big = benchCycles(fn, buf, BENCH_BIG);
+  debugA("%-24s %9u %9u %7u", label, small, big, big * 1000 / ESP.getCpuFreqMHz() / BENCH_BIG);
+}
+
+void runBenchmarks() {
+  CRGB* buf = (CRGB*)malloc(BENCH_BIG * sizeof(CRGB));
+  if (!buf) {
+    debugE("bench: not enough heap for %u pixels", BENCH_BIG);
+    return;
+  }
+  fill_rainbow(buf, BENCH_BIG, 0, 1);
+  debugA("%-24s %9s %9s %7s", "cycles per call", "88 px", "1000 px", "ns/px");
+
+  // Colour generation
+  benchPrimitive(PSTR("fill_rainbow"), [](CRGB* b, uint16_t n) { fill_rainbow(b, n, gHue, 3); }, buf);
+  benchPrimitive(PSTR("CRGB::setHSV"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) b[i].setHSV(i, 255, 200);
+  }, buf);
+  benchPrimitive(PSTR("ColorFromPalette"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) b[i] = ColorFromPalette(*velocityPalette, i);
+  }, buf);
+  benchPrimitive(PSTR("  table: keyPalette"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0, k = 0; i < n; i++) {
+      b[i] = keyPalette[k];
+      if (++k == NUM_LEDS) k = 0;
+    }
+  }, buf);
+
+  // Fading
+  benchPrimitive(PSTR("fadeToBlackBy (array)"), [](CRGB* b, uint16_t n) { fadeToBlackBy(b, n, 1); }, buf);
+  benchPrimitive(PSTR("CRGB::fadeToBlackBy"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) b[i].fadeToBlackBy(1);
+  }, buf);
+  benchPrimitive(PSTR("CRGB::fadeLightBy"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) b[i].fadeLightBy(1);
+  }, buf);
+  benchPrimitive(PSTR("  table: 256-entry fade"), [](CRGB* b, uint16_t n) {
+    uint8_t lut[256];
+    for (uint16_t v = 0; v < 256; v++) lut[v] = scale8(v, 254);
+    for (uint16_t i = 0; i < n; i++) {
+      b[i].r = lut[b[i].r];
+      b[i].g = lut[b[i].g];
+      b[i].b = lut[b[i].b];
+    }
+  }, buf);
+  benchPrimitive(PSTR("CRGB::getAverageLight"), [](CRGB* b, uint16_t n) {
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < n; i++) sum += b[i].getAverageLight();
+    benchSink = sum;
+  }, buf);
+  benchPrimitive(PSTR("  fixed: r|g|b test"), [](CRGB* b, uint16_t n) {
+    uint32_t lit = 0;
+    for (uint16_t i = 0; i < n; i++) lit += (b[i].r | b[i].g | b[i].b) != 0;
+    benchSink = lit;
+  }, buf);
+
+  // Kernels, the 1000 pixel column is the large-strip case
+  benchPrimitive(PSTR("scalarFade"), [](CRGB* b, uint16_t n) { scalarFade(b, n, 1); }, buf);
+  benchPrimitive(PSTR("  swar: swarFade"), [](CRGB* b, uint16_t n) { swarFade(b, n, 1); }, buf);
+  benchPrimitive(PSTR("scalarBlend"), [](CRGB* b, uint16_t n) { scalarBlend(b, b + (BENCH_BIG - n), n, 100); }, buf);
+  benchPrimitive(PSTR("  swar: swarBlend"), [](CRGB* b, uint16_t n) { swarBlend(b, b + (BENCH_BIG - n), n, 100); }, buf);
+
+  // Scalars, n calls
+  benchPrimitive(PSTR("beatsin8"), [](CRGB* b, uint16_t n) {
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < n; i++) sum += beatsin8(62, 64, 255);
+    benchSink = sum;
+  }, buf);
+  benchPrimitive(PSTR("beatsin16"), [](CRGB* b, uint16_t n) {
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < n; i++) sum += beatsin16(13, 0, NUM_LEDS-1);
+    benchSink = sum;
+  }, buf);
+  benchPrimitive(PSTR("  fixed: sin8 + phase"), [](CRGB* b, uint16_t n) {
+    uint32_t sum = 0;
+    uint16_t phase = 0;
+    for (uint16_t i = 0; i < n; i++) {
+      phase += 273;
+      sum += scale8(sin8(phase >> 8), 191) + 64;
+    }
+    benchSink = sum;
+  }, buf);
+  benchPrimitive(PSTR("random8"), [](CRGB* b, uint16_t n) {
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < n; i++) sum += random8();
+    benchSink = sum;
+  }, buf);
+  benchPrimitive(PSTR("random16"), [](CRGB* b, uint16_t n) {
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < n; i++) sum += random16(NUM_LEDS);
+    benchSink = sum;
+  }, buf);
+  benchPrimitive(PSTR("map (velocity)"), [](CRGB* b, uint16_t n) {
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < n; i++) sum += map(45 + (i & 63), 45, 100, MIN_BRIGHTNESS, 255);
+    benchSink = sum;
+  }, buf);
+  benchPrimitive(PSTR("  table: sustainFade"), [](CRGB* b, uint16_t n) {
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < n; i++) sum += sceneTables->sustainFade[i & 63];
+    benchSink = sum;
+  }, buf);
+
+  // The note frame pipeline fused vs one pass per stage, over n pixels in strips of NUM_LEDS
+  boolean savedOn[NUM_LEDS], savedFade[NUM_LEDS];
+  memcpy(savedOn, onLeds, sizeof(savedOn));
+  memcpy(savedFade, fadeLeds, sizeof(savedFade));
+  uint8_t savedBrightness = FastLED.getBrightness();
+  DensityState savedDensity = density;
+  benchPrimitive(PSTR("NoteFrame fused"), [](CRGB* b, uint16_t n) {
+    for (uint16_t done = 0; done < n; done += NUM_LEDS) NoteFrame::run(b + done, 0, min(n - done, NUM_LEDS));
+  }, buf);
+  benchPrimitive(PSTR("NoteFrame multi-pass"), [](CRGB* b, uint16_t n) {
+    for (uint16_t done = 0; done < n; done += NUM_LEDS) NoteFrame::runMultiPass(b + done, 0, min(n - done, NUM_LEDS));
+  }, buf);
+  memcpy(onLeds, savedOn, sizeof(onLeds));
+  memcpy(fadeLeds, savedFade, sizeof(fadeLeds));
+  FastLED.setBrightness(savedBrightness);
+  density = savedDensity;
+
+  // Resonance with every key ringing, the worst case. It and renderSweeps draw into leds[].
+  CRGB savedLeds[NUM_LEDS];
+  memcpy(savedLeds, leds, sizeof(savedLeds));
+  uint32_t savedRinging[KEY_WORDS], savedHeld[KEY_WORDS];
+  byte savedSustain = sustain;
+  memcpy(savedRinging, ringingMask, sizeof(savedRinging));
+  memcpy(savedHeld, heldMask, sizeof(savedHeld));
+  memset(ringingMask, 0xFF, sizeof(ringingMask));
+  sustain = 127;
+  benchPrimitive(PSTR("resonate"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) resonate(MAX_HARMONIC_OFFSET + i % (NUM_LEDS - MAX_HARMONIC_OFFSET), 255);
+  }, buf);
+  memcpy(ringingMask, savedRinging, sizeof(ringingMask));
+  memcpy(heldMask, savedHeld, sizeof(heldMask));
+  sustain = savedSustain;
+
+  // Prediction, n notes of a repeating phrase; learns into the live model, so it's saved and restored
+  NgramSlot* savedModel = (NgramSlot*)malloc(sizeof(ngram));
+  if (savedModel) {
+    memcpy(savedModel, ngram, sizeof(ngram));
+    bool savedOn = predictOn;
+    uint32_t savedCounts[3] = {predictNotes, predictTop1, predictTop2};
+    uint8_t savedPrev[2] = {ngramPrev[0], ngramPrev[1]};
+    predictOn = false;
+    benchPrimitive(PSTR("predictNext"), [](CRGB* b, uint16_t n) {
+      for (uint16_t i = 0; i < n; i++) predictNext(60 + (i * 7) % 12, 40);
+    }, buf);
+    predictOn = savedOn;
+    predictNotes = savedCounts[0]; predictTop1 = savedCounts[1]; predictTop2 = savedCounts[2];
+    memcpy(ngramPrev, savedPrev, sizeof(ngramPrev));
+    predicted[0] = predicted[1] = 0;
+    memcpy(ngram, savedModel, sizeof(ngram));
+    free(savedModel);
+  }
+
+  // Gesture detection, n notes of a glissando
+  GestureState saved = gesture;
+  benchPrimitive(PSTR("detectGesture"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) detectGesture(i % NUM_LEDS);
+  }, buf);
+  gesture = saved;
+
+  // Voice tracking, n notes of two lines; then n frames with every sweep running
+  Voice savedVoices[VOICES];
+  Sweep savedSweeps[SWEEPS];
+  memcpy(savedVoices, voices, sizeof(savedVoices));
+  memcpy(savedSweeps, sweeps, sizeof(savedSweeps));
+  benchPrimitive(PSTR("trackVoice"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) trackVoice(i & 1 ? 40 + i % 5 : 70 + i % 7, i % NUM_LEDS);
+  }, buf);
+  benchPrimitive(PSTR("renderSweeps (all)"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i += NUM_LEDS) {
+      for (byte k = 0; k < SWEEPS; k++) sweeps[k] = { 0, NUM_LEDS - 1, CRGB::Red, CRGB::Blue, millis() - SWEEP_MS / 2, true };
+      renderSweeps();
+    }
+  }, buf);
+  memcpy(voices, savedVoices, sizeof(voices));
+  memcpy(sweeps, savedSweeps, sizeof(sweeps));
+  memcpy(leds, savedLeds, sizeof(leds));
+
+  // Sub-pixel primitives, n of them at moving positions
+  benchPrimitive(PSTR("drawDot"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) drawDot(b, i * 23 % (NUM_LEDS * 256), CRGB::White);
+  }, buf);
+  benchPrimitive(PSTR("drawBar (8 LEDs)"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) drawBar(b, i * 23 % (80 * 256), i * 23 % (80 * 256) + 8 * 256, CRGB::White);
+  }, buf);
+  benchPrimitive(PSTR("drawComet (tail 6)"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) drawComet(b, i * 23 % (NUM_LEDS * 256), 1, COMET_TAIL, CRGB::White);
+  }, buf);
+  fill_rainbow(buf, BENCH_BIG, 0, 1);
+
+  // Ambient noise over n pixels: FastLED's inoise8, our field computed in full, and the field with
+  // cached coarse octaves as it runs at 25 frames/s
+  benchPrimitive(PSTR("inoise8, 4 octaves"), [](CRGB* b, uint16_t n) {
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < n; i++) {
+      for (byte k = 0; k < NOISE_OCTAVES; k++) sum += inoise8((i * 16) << k, (millis() * 4) << k) >> k;
+    }
+    benchSink = sum;
+  }, buf);
+  benchPrimitive(PSTR("  fixed: Noise octaves"), [](CRGB* b, uint16_t n) {
+    uint32_t sum = 0;
+    for (uint16_t i = 0; i < n; i++) sum += Noise::octaves(0, NOISE_OCTAVES, i % NUM_LEDS, 16, millis() * 4);
+    benchSink = sum;
+  }, buf);
+  // The bench runs the field on its own clock; both it and the live look start over
+  noiseLookId = NOISE_OFF;
+  static uint32_t benchFrameMs;
+  stepNoise(NOISE_WATER, benchFrameMs);
+  benchPrimitive(PSTR("  cached: stepNoise"), [](CRGB* b, uint16_t n) {
+    for (uint16_t done = 0; done < n; done += NUM_LEDS) stepNoise(NOISE_WATER, benchFrameMs += FRAME_MS);
+  }, buf);
+  noiseLookId = NOISE_OFF;
+
+#if TRACING
+  // n spans, begin and end; this overwrites the ring
+  bool savedFrozen = traceFrozen;
+  traceFrozen = false;
+  benchPrimitive(PSTR("TRACE_BEGIN + TRACE_END"), [](CRGB* b, uint16_t n) {
+    for (uint16_t i = 0; i < n; i++) {
+      TRACE_BEGIN(TRACE_EVENT, i);
+      TRACE_END(TRACE_EVENT);
+    }
+  }, buf);
+  traceHead = 0;
+  traceFilled = 0;
+  traceFrozen = savedFrozen;
+#endif
+
+  free(buf);
 }
 
 // PASSIVE PATTERNS FOR MODE 1 // TAKEN FROM FASTLED EXAMPLES
@@ -730,7 +3937,7 @@ void addGlitter( fract8 chanceOfGlitter)
 void confetti() 
 {
   // random colored speckles that blink in and fade smoothly
-  fadeToBlackBy( leds, NUM_LEDS, 10);
+  fadeKernel(leds, NUM_LEDS, 10);
   int pos = random16(NUM_LEDS);
   leds[pos] += CHSV( gHue + random8(64), 200, 255);
 }
@@ -738,9 +3945,8 @@ void confetti()
 void sinelon()
 {
   // a colored dot sweeping back and forth, with fading trails
-  fadeToBlackBy( leds, NUM_LEDS, 20);
-  int pos = beatsin16(13,0,NUM_LEDS-1);
-  leds[pos] += CHSV( gHue, 255, 192);
+  fadeKernel(leds, NUM_LEDS, 20);
+  drawDot(leds, beatsin16(13, 0, (NUM_LEDS-1) * 256), CHSV( gHue, 255, 192));
 }
 void bpm()
 {
@@ -753,12 +3959,16 @@ void bpm()
   }
 }
 
+void lava() { fillNoise(NOISE_LAVA); }
+void water() { fillNoise(NOISE_WATER); }
+void aurora() { fillNoise(NOISE_AURORA); }
+
 void juggle() {
   // eight colored dots, weaving in and out of sync with each other
-  fadeToBlackBy( leds, NUM_LEDS, 20);
+  fadeKernel(leds, NUM_LEDS, 20);
   byte dothue = 0;
   for( int i = 0; i < 8; i++) {
-    leds[beatsin16( i+7, 0, NUM_LEDS-1 )] |= CHSV(dothue, 200, 255);
+    drawDot(leds, beatsin16( i+7, 0, (NUM_LEDS-1) * 256 ), CHSV(dothue, 200, 255));
     dothue += 32;
   }
 }
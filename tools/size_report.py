@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""RAM / IRAM / flash usage of the PianoLED sketch, per subsystem.
+
+Usage: size_report.py PianoLED.ino.elf [path/to/xtensa-lx106-elf-nm]
+
+The ELF is left in the Arduino build folder (or use Sketch > Export compiled binary).
+Symbols are bucketed by address on the ESP8266 memory map and by name into subsystems,
+see SUBSYSTEMS below. Run it on two builds (e.g. HOT_PATH_IN_IRAM true/false) to compare.
+"""
+import re
+import subprocess
+import sys
+
+# First match wins, anything unmatched goes to "core/libs"
+SUBSYSTEMS = [
+    ("notes", r"OnNote|OnControlChange|OnProgramChange|OnMidiSysEx|getSysExStatus|noteOn|noteOff|wifiNote|controlChange|noteLed|velocityBrightness|velocityIndex"),
+    ("visualizer", r"[Vv]iz|spark|frameMicros"),
+    ("replay", r"[Rr]eplay|releaseAllNotes"),
+    ("network limits", r"[Ww]ifiPeer|admitWifi|wifiQueued|currentPeer|readMidiInputs|printNetworkReport|[Ff]lood"),
+    ("cues", r"[Cc]ue|frameDue"),
+    ("tracing", r"[Tt]race"),
+    ("noise field", r"[Nn]oise|[Bb]ackground|GP_Aurora|^lava|^water|^aurora"),
+    ("event queue", r"MidiEvent|[Ee]vent"),
+    ("prediction", r"ngram|[Pp]redict"),
+    ("song files", r"[Ss]ong|[Ll]oop(Start|End)Event"),
+    ("score following", r"[Ff]ollow|[Ss]core|builtinSong"),
+    ("sub-pixel", r"SubPixel|[Ss]ubpixel|dotWeights|cometFalloff|drawDot|drawBar|drawComet"),
+    ("gestures", r"[Gg]esture"),
+    ("voice sweeps", r"[Vv]oice|[Ss]weep"),
+    ("interval spans", r"[Ss]pans?[A-Z]|renderSpans|intervalColors"),
+    ("resonance", r"[Rr]esonan|overtoneMask|harmonic|heldMask|ringingMask|KeyBit"),
+    ("note density", r"[Dd]ensity|[Cc]ontrast|countNote"),
+    ("frame pipeline", r"Pipeline|ExpireStage|EnvelopeStage|PowerStage"),
+    ("kernels", r"[Ss]warFade|[Ss]warBlend|scalarFade|scalarBlend|[Kk]ernel"),
+    ("render", r"showLeds|showPassive|^leds$|onLeds|fadeLeds|doNotFade|keyPalette|velocityPalette|Morph|morph|keyColor|fillKeyColors"),
+    ("palettes", r"^GP|mode4|mode5"),
+    ("presets", r"[Pp]reset|^scene|rememberScene"),
+    ("settings", r"[Ss]ettings|^config|applySetting"),
+    ("stall detector", r"[Ff]light|[Ss]tall|[Ss]tage|loopStarted|loopCount|loopMicros|custom_crash_callback|printMemoryReport"),
+    ("passive patterns", r"^rainbow|confetti|sinelon|^bpm|juggle|gPatterns|nextPattern|addGlitter"),
+    ("inputs", r"handleInputs|[Ee]ncoder|setUpInputPins|handlePaletteChange|sleepMode"),
+    ("network", r"WiFi|wifi|AppleMIDI|MIDI_WIFI|OTA|Ota|RemoteDebug|Debug|lwip|tcp_|udp_|pbuf|etharp|ip4|dhcp|dns|mdns|MDNS"),
+    ("midi", r"^MIDI$|midi::|MidiInterface"),
+    ("fastled", r"FastLED|CLEDController|ColorFromPalette|hsv2rgb|CRGBPalette|fill_|fadeTo|nscale8|blend|ClocklessController|CPixelLEDController"),
+]
+
+
+def region(addr):
+    if 0x40100000 <= addr < 0x40108000:
+        return "iram"
+    if 0x40200000 <= addr < 0x40300000:
+        return "flash"
+    if 0x3FFE8000 <= addr < 0x40000000:
+        return "ram"
+    return None
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    nm = sys.argv[2] if len(sys.argv) > 2 else "xtensa-lx106-elf-nm"
+    out = subprocess.run([nm, "-S", "-C", "--size-sort", sys.argv[1]],
+                         check=True, capture_output=True, text=True).stdout
+
+    totals = {}
+    for line in out.splitlines():
+        parts = line.split(None, 3)
+        if len(parts) < 4:
+            continue
+        addr, size, _, name = int(parts[0], 16), int(parts[1], 16), parts[2], parts[3]
+        where = region(addr)
+        if where is None:
+            continue
+        subsystem = "core/libs"
+        for label, pattern in SUBSYSTEMS:
+            if re.search(pattern, name):
+                subsystem = label
+                break
+        row = totals.setdefault(subsystem, {"ram": 0, "iram": 0, "flash": 0})
+        row[where] += size
+
+    print("%-18s %8s %8s %8s" % ("subsystem", "RAM", "IRAM", "flash"))
+    order = [label for label, _ in SUBSYSTEMS] + ["core/libs"]
+    sums = {"ram": 0, "iram": 0, "flash": 0}
+    for label in order:
+        if label not in totals:
+            continue
+        row = totals[label]
+        print("%-18s %8d %8d %8d" % (label, row["ram"], row["iram"], row["flash"]))
+        for k in sums:
+            sums[k] += row[k]
+    print("%-18s %8d %8d %8d" % ("total", sums["ram"], sums["iram"], sums["flash"]))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+"""Compile a Standard MIDI File into the PianoLED song format (.pls).
+
+Usage: song_compile.py song.mid [out.pls] [--bars-per-index=N] [--hands=auto|channel|none]
+
+Upload the result as data/song.pls (LittleFS) and "song reload" over telnet, or reboot.
+Everything the sketch would otherwise resolve on the fly is done here: the tempo map is
+applied (absolute milliseconds), all tracks are merged into one time-ordered list of notes,
+each note is tagged with its channel and hand, and a bar index makes seeking a single read.
+
+Layout, little endian, all parts 8-byte aligned so no record straddles a 256-byte cache block:
+  header  16 bytes  magic "PLS1", u16 events, u16 index entries, u16 bars per index,
+                    u16 reserved, u32 duration ms
+  index    8 bytes  u32 ms, u16 first event, u16 bar         (one per N bars)
+  events   8 bytes  u32 ms, u8 pitch, u8 velocity, u8 tag, u8 duration in 16 ms units
+tag: channel (0-15) in bits 0-3, hand in bits 4-5 (0 unknown, 1 right, 2 left).
+"""
+import struct
+import sys
+
+MAGIC = b"PLS1"
+HAND_UNKNOWN, HAND_RIGHT, HAND_LEFT = 0, 1, 2
+DURATION_UNIT_MS = 16
+
+
+def read_varlen(data, pos):
+    value = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value = (value << 7) | (byte & 0x7F)
+        if not byte & 0x80:
+            return value, pos
+
+
+def parse_smf(data):
+    """Returns (division, tracks), each track a list of (tick, kind, payload)."""
+    if data[:4] != b"MThd":
+        sys.exit("not a Standard MIDI File")
+    length, fmt, ntracks, division = struct.unpack(">IHHH", data[4:14])
+    if division & 0x8000:
+        sys.exit("SMPTE time division is not supported")
+    pos = 8 + length
+    tracks = []
+    while pos < len(data) and len(tracks) < ntracks:
+        chunk, size = data[pos:pos + 4], struct.unpack(">I", data[pos + 4:pos + 8])[0]
+        pos += 8
+        if chunk == b"MTrk":
+            tracks.append(parse_track(data[pos:pos + size]))
+        pos += size
+    return division, tracks
+
+
+def parse_track(data):
+    events = []
+    pos, tick, status = 0, 0, 0
+    while pos < len(data):
+        delta, pos = read_varlen(data, pos)
+        tick += delta
+        if data[pos] & 0x80:
+            status = data[pos]
+            pos += 1
+        kind = status & 0xF0
+        if status == 0xFF:
+            meta = data[pos]
+            length, pos = read_varlen(data, pos + 1)
+            body = data[pos:pos + length]
+            pos += length
+            if meta == 0x51:
+                events.append((tick, "tempo", int.from_bytes(body, "big")))
+            elif meta == 0x58:
+                events.append((tick, "meter", (body[0], 2 ** body[1])))
+            elif meta == 0x2F:
+                break
+        elif status in (0xF0, 0xF7):
+            length, pos = read_varlen(data, pos)
+            pos += length
+        elif kind in (0x80, 0x90):
+            pitch, velocity = data[pos], data[pos + 1]
+            pos += 2
+            on = kind == 0x90 and velocity > 0
+            events.append((tick, "on" if on else "off", (status & 0x0F, pitch, velocity)))
+        elif kind in (0xA0, 0xB0, 0xE0):
+            pos += 2
+        elif kind in (0xC0, 0xD0):
+            pos += 1
+        else:
+            sys.exit("bad MIDI data at byte %d of a track" % pos)
+    return events
+
+
+class TempoMap:
+    def __init__(self, division, changes):
+        self.division = division
+        self.points = [(0, 0.0, 500000)]  # tick, ms at tick, us per quarter
+        for tick, tempo in sorted(changes):
+            last_tick, last_ms, last_tempo = self.points[-1]
+            ms = last_ms + (tick - last_tick) * last_tempo / division / 1000.0
+            if tick == last_tick:
+                self.points[-1] = (tick, last_ms, tempo)
+            else:
+                self.points.append((tick, ms, tempo))
+
+    def ms(self, tick):
+        point = self.points[0]
+        for p in self.points:
+            if p[0] > tick:
+                break
+            point = p
+        return point[1] + (tick - point[0]) * point[2] / self.division / 1000.0
+
+
+def bar_starts(division, meters, end_tick):
+    """Tick of every bar start up to end_tick."""
+    changes = dict(sorted(meters)) or {0: (4, 4)}
+    if 0 not in changes:
+        changes[0] = (4, 4)
+    starts, tick = [], 0
+    meter = changes[0]
+    while tick <= end_tick:
+        for t in sorted(changes):
+            if t <= tick:
+                meter = changes[t]
+        starts.append(tick)
+        tick += division * 4 * meter[0] // meter[1]
+    return starts
+
+
+def compile_song(data, bars_per_index=1, hands="auto"):
+    division, tracks = parse_smf(data)
+    tempos = [(t, v) for track in tracks for t, k, v in track if k == "tempo"]
+    meters = [(t, v) for track in tracks for t, k, v in track if k == "meter"]
+    tempo_map = TempoMap(division, tempos)
+
+    note_tracks = [i for i, track in enumerate(tracks) if any(k == "on" for _, k, _ in track)]
+    notes = []  # tick, pitch, velocity, channel, hand, end tick
+    for order, index in enumerate(note_tracks):
+        if hands == "auto" and len(note_tracks) >= 2:
+            hand = HAND_RIGHT if order == 0 else HAND_LEFT if order == 1 else HAND_UNKNOWN
+        else:
+            hand = None
+        held = {}
+        for tick, kind, value in tracks[index]:
+            if kind not in ("on", "off"):
+                continue
+            channel, pitch, velocity = value
+            key = (channel, pitch)
+            if key in held:  # note off, or a retrigger that ends the previous one
+                start = held.pop(key)
+                start[5] = tick
+            if kind == "on":
+                if hand is None:
+                    tag_hand = {0: HAND_RIGHT, 1: HAND_LEFT}.get(channel, HAND_UNKNOWN) if hands == "channel" else HAND_UNKNOWN
+                else:
+                    tag_hand = hand
+                note = [tick, pitch, velocity, channel, tag_hand, tick]
+                held[key] = note
+                notes.append(note)
+        for note in held.values():
+            note[5] = max(note[5], note[0])
+    if not notes:
+        sys.exit("no notes in the file")
+    if len(notes) > 0xFFFF:
+        sys.exit("too many notes (%d), the format holds 65535" % len(notes))
+
+    # Chords in pitch order, so the sequence is the same whatever the track order
+    notes.sort(key=lambda n: (n[0], n[1]))
+    end_tick = max(n[5] for n in notes)
+    bars = bar_starts(division, meters, end_tick)
+
+    events = []
+    for tick, pitch, velocity, channel, hand, off in notes:
+        start_ms = tempo_map.ms(tick)
+        duration = int(round((tempo_map.ms(off) - start_ms) / DURATION_UNIT_MS))
+        events.append(struct.pack("<IBBBB", int(round(start_ms)), pitch, velocity,
+                                  (channel & 0x0F) | hand << 4, min(max(duration, 1), 255)))
+
+    index = []
+    event = 0
+    for bar in range(0, len(bars), bars_per_index):
+        while event < len(notes) and notes[event][0] < bars[bar]:
+            event += 1
+        index.append(struct.pack("<IHH", int(round(tempo_map.ms(bars[bar]))), event, bar))
+    if len(index) > 0xFFFF:
+        sys.exit("too many bars for the index")
+
+    duration_ms = int(round(tempo_map.ms(end_tick)))
+    header = MAGIC + struct.pack("<HHHHI", len(events), len(index), bars_per_index, 0, duration_ms)
+    summary = "%d notes, %d bars, %d index entries, %.1f s" % (len(events), len(bars), len(index), duration_ms / 1000.0)
+    return header + b"".join(index) + b"".join(events), summary
+
+
+def main():
+    args = [a for a in sys.argv[1:] if not a.startswith("--")]
+    options = dict(a[2:].split("=", 1) if "=" in a else (a[2:], "") for a in sys.argv[1:] if a.startswith("--"))
+    if not args:
+        sys.exit(__doc__)
+    bars_per_index = int(options.get("bars-per-index", 1))
+    hands = options.get("hands", "auto")
+    if bars_per_index < 1 or hands not in ("auto", "channel", "none"):
+        sys.exit(__doc__)
+    out = args[1] if len(args) > 1 else args[0].rsplit(".", 1)[0] + ".pls"
+    with open(args[0], "rb") as f:
+        song, summary = compile_song(f.read(), bars_per_index, hands)
+    with open(out, "wb") as f:
+        f.write(song)
+    print("%s: %s, %d bytes" % (out, summary, len(song)))
+
+
+if __name__ == "__main__":
+    main()